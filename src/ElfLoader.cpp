@@ -0,0 +1,146 @@
+#include "ElfLoader.h"
+
+#include <elf.h>
+
+#include <cstring>
+#include <iostream>
+
+#include "MappedFile.h"
+
+#ifndef EM_RISCV
+#define EM_RISCV 243
+#endif
+
+bool isElfFile(const char* fileName) {
+    std::ifstream file(fileName, std::ios::binary | std::ios::in);
+    char magic[SELFMAG];
+    return file.read(magic, SELFMAG) && std::memcmp(magic, ELFMAG, SELFMAG) == 0;
+}
+
+// Header tables are read with memcpy since nothing aligns them in the mapping; the
+// simulator only runs on little-endian hosts, so fields need no swapping.
+template <class T>
+static T readEntry(const MappedFile& file, uint64_t offset) {
+    T entry;
+    std::memcpy(&entry, file.getData() + offset, sizeof(T));
+    return entry;
+}
+
+static Status loadSegments(const MappedFile& file, const Elf64_Ehdr& header, MemoryStore* mem) {
+    if (header.e_phentsize != sizeof(Elf64_Phdr) ||
+        !file.contains(header.e_phoff, header.e_phnum, sizeof(Elf64_Phdr))) {
+        std::cerr << LOG_ERROR << "Truncated ELF program headers" << std::endl;
+        return ERROR;
+    }
+    for (uint64_t i = 0; i < header.e_phnum; i++) {
+        auto segment = readEntry<Elf64_Phdr>(file, header.e_phoff + i * sizeof(Elf64_Phdr));
+        if (segment.p_type != PT_LOAD) {
+            continue;
+        }
+        if (segment.p_filesz > segment.p_memsz || !file.contains(segment.p_offset, segment.p_filesz, 1)) {
+            std::cerr << LOG_ERROR << "Malformed ELF segment " << i << std::endl;
+            return ERROR;
+        }
+        // the file bytes in one copy, then the rest of the segment (bss) zeroed
+        if (mem->writeBytes(segment.p_vaddr, file.getData() + segment.p_offset, segment.p_filesz) ||
+            mem->writeBytes(segment.p_vaddr + segment.p_filesz, nullptr,
+                            segment.p_memsz - segment.p_filesz)) {
+            std::cerr << LOG_ERROR << "ELF segment " << i << " does not fit in memory" << std::endl;
+            return ERROR;
+        }
+    }
+    return SUCCESS;
+}
+
+Status loadElf(const char* fileName, MemoryStore* mem, ElfImage& image) {
+    MappedFile file(fileName);
+    if (!file.getData()) {
+        std::cerr << LOG_ERROR << "Unable to map ELF file " << fileName << std::endl;
+        return ERROR;
+    }
+    if (!file.contains(0, 1, sizeof(Elf64_Ehdr))) {
+        std::cerr << LOG_ERROR << "Truncated ELF header in " << fileName << std::endl;
+        return ERROR;
+    }
+    auto header = readEntry<Elf64_Ehdr>(file, 0);
+    if (std::memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 || header.e_ident[EI_CLASS] != ELFCLASS64 ||
+        header.e_ident[EI_DATA] != ELFDATA2LSB || header.e_machine != EM_RISCV) {
+        std::cerr << LOG_ERROR << fileName << " is not a little-endian RISC-V ELF64 file" << std::endl;
+        return ERROR;
+    }
+    if (header.e_type != ET_EXEC && header.e_type != ET_REL) {
+        std::cerr << LOG_ERROR << "Unsupported ELF type " << header.e_type << " in " << fileName
+                  << std::endl;
+        return ERROR;
+    }
+
+    if (header.e_type == ET_EXEC && loadSegments(file, header, mem) != SUCCESS) {
+        return ERROR;
+    }
+    image.entry = header.e_type == ET_EXEC ? header.e_entry : 0;
+    image.symbols.clear();
+
+    // sections: .text of relocatable objects and the symbol table
+    if (header.e_shnum == 0) {
+        return SUCCESS;
+    }
+    if (header.e_shentsize != sizeof(Elf64_Shdr) ||
+        !file.contains(header.e_shoff, header.e_shnum, sizeof(Elf64_Shdr)) ||
+        header.e_shstrndx >= header.e_shnum) {
+        std::cerr << LOG_ERROR << "Truncated ELF section headers" << std::endl;
+        return ERROR;
+    }
+    auto section = [&](uint64_t index) {
+        return readEntry<Elf64_Shdr>(file, header.e_shoff + index * sizeof(Elf64_Shdr));
+    };
+    // name at offset in the string table section strtab, empty if out of range
+    auto stringAt = [&](const Elf64_Shdr& strtab, uint64_t offset) {
+        if (offset >= strtab.sh_size || !file.contains(strtab.sh_offset, strtab.sh_size, 1)) {
+            return std::string();
+        }
+        const char* start = reinterpret_cast<const char*>(file.getData() + strtab.sh_offset + offset);
+        return std::string(start, strnlen(start, strtab.sh_size - offset));
+    };
+
+    Elf64_Shdr names = section(header.e_shstrndx);
+    uint64_t textIndex = SHN_UNDEF;
+    for (uint64_t i = 1; i < header.e_shnum; i++) {
+        if (section(i).sh_type == SHT_PROGBITS && stringAt(names, section(i).sh_name) == ".text") {
+            textIndex = i;
+            break;
+        }
+    }
+    if (header.e_type == ET_REL) {
+        Elf64_Shdr text = textIndex != SHN_UNDEF ? section(textIndex) : Elf64_Shdr();
+        if (textIndex == SHN_UNDEF || !file.contains(text.sh_offset, text.sh_size, 1) ||
+            mem->writeBytes(0, file.getData() + text.sh_offset, text.sh_size)) {
+            std::cerr << LOG_ERROR << "No loadable .text section in " << fileName << std::endl;
+            return ERROR;
+        }
+    }
+
+    for (uint64_t i = 1; i < header.e_shnum; i++) {
+        Elf64_Shdr symtab = section(i);
+        if (symtab.sh_type != SHT_SYMTAB || symtab.sh_entsize != sizeof(Elf64_Sym) ||
+            symtab.sh_link >= header.e_shnum ||
+            !file.contains(symtab.sh_offset, symtab.sh_size / sizeof(Elf64_Sym), sizeof(Elf64_Sym))) {
+            continue;
+        }
+        Elf64_Shdr strtab = section(symtab.sh_link);
+        for (uint64_t j = 1; j < symtab.sh_size / sizeof(Elf64_Sym); j++) {
+            auto symbol = readEntry<Elf64_Sym>(file, symtab.sh_offset + j * sizeof(Elf64_Sym));
+            int type = ELF64_ST_TYPE(symbol.st_info);
+            // section offsets only turn into addresses for .text of relocatable objects
+            bool placed = header.e_type == ET_EXEC ? symbol.st_shndx != SHN_UNDEF
+                                                   : symbol.st_shndx == textIndex;
+            if (!placed || type == STT_SECTION || type == STT_FILE) {
+                continue;
+            }
+            std::string name = stringAt(strtab, symbol.st_name);
+            if (!name.empty()) {
+                image.symbols[name] = symbol.st_value;
+            }
+        }
+    }
+    return SUCCESS;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <inttypes.h>
+
+#include <map>
+#include <string>
+
+#include "MemoryStore.h"
+#include "Utilities.h"
+
+// What loadElf() keeps of an ELF file besides the memory contents.
+struct ElfImage {
+    uint64_t entry = 0;
+    // address of every named function and object symbol
+    std::map<std::string, uint64_t> symbols;
+};
+
+// true if fileName starts with the ELF magic
+bool isElfFile(const char* fileName);
+
+// Map a little-endian RISC-V ELF64 file and copy it into mem. Executables have
+// every PT_LOAD segment copied to its virtual address and its bss zeroed;
+// relocatable objects (what the assembler emits) have .text placed at 0 like
+// the objcopy'd .bin files.
+Status loadElf(const char* fileName, MemoryStore* mem, ElfImage& image);
@@ -0,0 +1,44 @@
+#pragma once
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only mapping of a whole file, unmapped when it goes out of scope.
+class MappedFile {
+   private:
+    const uint8_t* data = nullptr;
+    uint64_t size = 0;
+
+   public:
+    explicit MappedFile(const char* fileName) {
+        int fd = open(fileName, O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                data = static_cast<const uint8_t*>(mapped);
+                size = info.st_size;
+            }
+        }
+        close(fd);
+    }
+    ~MappedFile() {
+        if (data) {
+            munmap(const_cast<uint8_t*>(data), size);
+        }
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* getData() const { return data; }
+    uint64_t getSize() const { return size; }
+    // true if count entries of entrySize bytes at offset lie inside the file
+    bool contains(uint64_t offset, uint64_t count, uint64_t entrySize) const {
+        return offset <= size && (entrySize == 0 || count <= (size - offset) / entrySize);
+    }
+};
@@ -1,17 +1,21 @@
 #include "MemoryStore.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <new>
 
+#include "MappedFile.h"
 #include "Utilities.h"
 
 MemoryStore::MemoryStore(uint64_t startAddr, uint64_t numEntries)
-    : startAddr(startAddr) {
-    // fill memory array with 0s
-    memArr.resize(numEntries);
-    std::fill(memArr.begin(), memArr.end(), 0);
+    : startAddr(startAddr), numEntries(numEntries) {
+    // pages start out unallocated and read as 0s
+    initPages();
 
     // If we can't initialise memory appropriately, don't return a
     // MemoryStore at all.
@@ -19,10 +23,9 @@ MemoryStore::MemoryStore(uint64_t startAddr, uint64_t numEntries)
 }
 
 MemoryStore::MemoryStore(uint64_t startAddr, uint64_t numEntries, const char *fileName)
-    : startAddr(startAddr) {
-    // fill memory array with 0s
-    memArr.resize(numEntries);
-    std::fill(memArr.begin(), memArr.end(), 0);
+    : startAddr(startAddr), numEntries(numEntries) {
+    // pages start out unallocated and read as 0s
+    initPages();
 
     // If we can't initialise memory appropriately, don't return a
     // MemoryStore at all.
@@ -31,9 +34,46 @@ MemoryStore::MemoryStore(uint64_t startAddr, uint64_t numEntries, const char *fi
     loadFromFile(fileName);
 }
 
-int prepareMemory(MemoryStore *mem) {
+// empty for the default init_mem_image, which may be missing
+static std::vector<std::string> memoryImages;
+
+bool setMemoryImages(const std::vector<std::string> &fileNames) {
+    for (const auto &fileName : fileNames) {
+        if (!std::ifstream(fileName)) {
+            std::cerr << LOG_ERROR << "Unable to open memory image " << fileName << std::endl;
+            return false;
+        }
+    }
+    memoryImages = fileNames;
+    return true;
+}
+
+// Copy every range of a binary image straight out of the mapped file.
+static int loadBinaryImage(MemoryStore *mem, const MappedFile &image, const std::string &fileName) {
+    uint64_t offset = 2 * sizeof(uint32_t);
+    while (offset < image.getSize()) {
+        uint64_t range[2];
+        if (!image.contains(offset, 2, sizeof(uint64_t))) {
+            std::cerr << LOG_ERROR << "Truncated range header in " << fileName << std::endl;
+            return -EINVAL;
+        }
+        std::memcpy(range, image.getData() + offset, sizeof(range));
+        offset += sizeof(range);
+        if (!image.contains(offset, range[1], 1)) {
+            std::cerr << LOG_ERROR << "Truncated range payload in " << fileName << std::endl;
+            return -EINVAL;
+        }
+        if (mem->writeBytes(range[0], image.getData() + offset, range[1])) {
+            return -EINVAL;
+        }
+        offset += range[1];
+    }
+    return 0;
+}
+
+static int loadTextImage(MemoryStore *mem, const std::string &fileName) {
     std::ifstream initMem;
-    initMem.open("init_mem_image", std::ios::in);
+    initMem.open(fileName, std::ios::in);
 
     // For tests that don't require such an initial memory image, nothing is done.
     while (initMem && mem) {
@@ -54,7 +94,143 @@ int prepareMemory(MemoryStore *mem) {
     return 0;
 }
 
-int MemoryStore::getOrSetValue(bool get, uint64_t address, uint64_t &value, MemEntrySize size) {
+int prepareMemory(MemoryStore *mem) {
+    std::vector<std::string> images = memoryImages;
+    if (images.empty()) {
+        images.push_back("init_mem_image");
+    }
+    for (const auto &fileName : images) {
+        MappedFile image(fileName.c_str());
+        uint32_t header[2] = {0, 0};
+        if (image.contains(0, 2, sizeof(uint32_t))) {
+            std::memcpy(header, image.getData(), sizeof(header));
+        }
+        int ret = 0;
+        if (header[0] != MEM_IMAGE_MAGIC) {
+            ret = loadTextImage(mem, fileName);
+        } else if (header[1] != MEM_IMAGE_VERSION) {
+            std::cerr << LOG_ERROR << "Unsupported memory image version " << header[1] << " in "
+                      << fileName << std::endl;
+            ret = -EINVAL;
+        } else {
+            ret = loadBinaryImage(mem, image, fileName);
+        }
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+bool parseMemorySize(const char *text, uint64_t &size) {
+    char *end = nullptr;
+    errno = 0;
+    uint64_t value = strtoull(text, &end, 0);
+    if (errno != 0 || end == text || *end != '\0' || value == 0) {
+        return false;
+    }
+    size = value;
+    return true;
+}
+
+// Memory is little-endian; swap on big-endian hosts so the raw copies below read the same values.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+static inline uint8_t littleEndian(uint8_t value) { return value; }
+static inline uint16_t littleEndian(uint16_t value) { return __builtin_bswap16(value); }
+static inline uint32_t littleEndian(uint32_t value) { return __builtin_bswap32(value); }
+static inline uint64_t littleEndian(uint64_t value) { return __builtin_bswap64(value); }
+#else
+template <class T>
+static inline T littleEndian(T value) { return value; }
+#endif
+
+// Unaligned load or store of one T at bytes; memcpy of a constant size compiles to a single move.
+template <class T>
+static inline void accessValue(bool get, uint8_t *bytes, uint64_t &value) {
+    T raw;
+    if (get) {
+        std::memcpy(&raw, bytes, sizeof(T));
+        value = littleEndian(raw);
+    } else {
+        raw = littleEndian(static_cast<T>(value));
+        std::memcpy(bytes, &raw, sizeof(T));
+    }
+}
+
+MemoryStore::MemoryStore(const MemoryStore &other)
+    : startAddr(other.startAddr), numEntries(other.numEntries), numLevels(other.numLevels),
+      root(other.root), ownedPages(0), lastPageNumber(0), lastPage(nullptr), lastPageWritable(false) {}
+
+std::unique_ptr<MemoryStore> MemoryStore::clone() {
+    // pages cached as writable are shared from now on
+    lastPageWritable = false;
+    return std::unique_ptr<MemoryStore>(new MemoryStore(*this));
+}
+
+void MemoryStore::initPages() {
+    uint64_t numPages = (numEntries >> MEM_PAGE_BITS) + 1;
+    numLevels = 1;
+    while (numLevels * MEM_RADIX_BITS < 64 - MEM_PAGE_BITS && (numPages >> (numLevels * MEM_RADIX_BITS)) > 0) {
+        numLevels++;
+    }
+    ownedPages = 0;
+    lastPageNumber = 0;
+    lastPage = nullptr;
+    lastPageWritable = false;
+}
+
+uint8_t *MemoryStore::findPage(uint64_t pageNumber, bool write) {
+    const uint64_t slotMask = (1 << MEM_RADIX_BITS) - 1;
+    RadixNode *node = &root;
+    uint8_t *page = nullptr;
+    if (write) {
+        for (int level = numLevels - 1; level > 0; level--) {
+            node = static_cast<RadixNode *>(
+                ownSlot(node->slots[(pageNumber >> (level * MEM_RADIX_BITS)) & slotMask], false));
+        }
+        page = static_cast<uint8_t *>(ownSlot(node->slots[pageNumber & slotMask], true));
+    } else {
+        for (int level = numLevels - 1; level > 0 && node; level--) {
+            node = static_cast<RadixNode *>(node->slots[(pageNumber >> (level * MEM_RADIX_BITS)) & slotMask].get());
+        }
+        page = node ? static_cast<uint8_t *>(node->slots[pageNumber & slotMask].get()) : nullptr;
+    }
+    if (page) {
+        lastPageNumber = pageNumber;
+        lastPage = page;
+        lastPageWritable = write;
+    }
+    return page;
+}
+
+// Make slot point to a node or page referenced by this store only, allocating it or
+// copying the one shared with clones.
+void *MemoryStore::ownSlot(std::shared_ptr<void> &slot, bool isPage) {
+    if (slot && slot.use_count() == 1) {
+        return slot.get();
+    }
+    if (!isPage) {
+        slot = slot ? std::make_shared<RadixNode>(*static_cast<RadixNode *>(slot.get()))
+                    : std::make_shared<RadixNode>();
+        return slot.get();
+    }
+    void *bytes = nullptr;
+    if (posix_memalign(&bytes, MEM_PAGE_SIZE, MEM_PAGE_SIZE) != 0) {
+        throw std::bad_alloc();
+    }
+    if (slot) {
+        std::memcpy(bytes, slot.get(), MEM_PAGE_SIZE);
+    } else {
+        std::memset(bytes, 0, MEM_PAGE_SIZE);
+    }
+    slot.reset(bytes, free);
+    ownedPages++;
+    return bytes;
+}
+
+// get is a template parameter so getMemValue and setMemValue each get their own straight-line copy
+template <bool get>
+int MemoryStore::getOrSetValue(uint64_t address, uint64_t &value, MemEntrySize size) {
     uint64_t byteSize = static_cast<uint64_t>(size);
     switch (size) {
         case BYTE_SIZE:
@@ -68,31 +244,129 @@ int MemoryStore::getOrSetValue(bool get, uint64_t address, uint64_t &value, MemE
     }
 
     uint64_t relativeAddr = address - startAddr;
-    try {
+    // a single check covers every byte of the access; addresses below startAddr wrap
+    // around to huge relative addresses and fail it too
+    if (relativeAddr >= numEntries || numEntries - relativeAddr < byteSize) {
+        // a faulting load reads as 0, as the simulator expects
         if (get) {
             value = 0;
-            for (uint64_t i = 0; i < byteSize; ++i) {
-                value |= ((uint64_t)memArr.at(relativeAddr + i) << (i * 8));
-            }
-        } else {
-            for (uint64_t i = 0; i < byteSize; ++i) {
-                memArr.at(relativeAddr + i) = (value >> (i * 8)) & 0xFF;
-            }
         }
-    } catch (const std::out_of_range &e) {
         std::cerr << LOG_ERROR << "Access violation at address 0x" << std::hex << address << std::endl;
         return -EINVAL;
     }
 
+    uint64_t offset = relativeAddr & (MEM_PAGE_SIZE - 1);
+    if (offset + byteSize > MEM_PAGE_SIZE) {
+        // rare access straddling two pages, split into bytes
+        if (get) {
+            value = 0;
+        }
+        for (uint64_t i = 0; i < byteSize; i++) {
+            uint8_t *page = findPage((relativeAddr + i) >> MEM_PAGE_BITS, !get);
+            uint64_t pageOffset = (relativeAddr + i) & (MEM_PAGE_SIZE - 1);
+            if (get) {
+                value |= (uint64_t)(page ? page[pageOffset] : 0) << (i * 8);
+            } else {
+                page[pageOffset] = (value >> (i * 8)) & 0xFF;
+            }
+        }
+        return 0;
+    }
+
+    uint64_t pageNumber = relativeAddr >> MEM_PAGE_BITS;
+    uint8_t *page = (pageNumber == lastPageNumber && lastPage && (get || lastPageWritable))
+                        ? lastPage
+                        : findPage(pageNumber, !get);
+    if (!page) {
+        // never written
+        value = 0;
+        return 0;
+    }
+    uint8_t *bytes = page + offset;
+    switch (size) {
+        case BYTE_SIZE:
+            accessValue<uint8_t>(get, bytes, value);
+            break;
+        case HALF_SIZE:
+            accessValue<uint16_t>(get, bytes, value);
+            break;
+        case WORD_SIZE:
+            accessValue<uint32_t>(get, bytes, value);
+            break;
+        case DOUBLE_SIZE:
+            accessValue<uint64_t>(get, bytes, value);
+            break;
+    }
     return 0;
 }
 
 int MemoryStore::getMemValue(uint64_t address, uint64_t &value, MemEntrySize size) {
-    return getOrSetValue(true, address, value, size);
+    return getOrSetValue<true>(address, value, size);
 }
 
 int MemoryStore::setMemValue(uint64_t address, uint64_t value, MemEntrySize size) {
-    return getOrSetValue(false, address, value, size);
+    return getOrSetValue<false>(address, value, size);
+}
+
+uint8_t *MemoryStore::pageBytes(uint64_t address, bool write) {
+    uint64_t relativeAddr = address - startAddr;
+    uint64_t pageStart = relativeAddr & ~(MEM_PAGE_SIZE - 1);
+    if ((startAddr & (MEM_PAGE_SIZE - 1)) != 0 || relativeAddr >= numEntries ||
+        numEntries - pageStart < MEM_PAGE_SIZE) {
+        return nullptr;
+    }
+    return findPage(relativeAddr >> MEM_PAGE_BITS, write);
+}
+
+bool MemoryStore::sameSlots(const RadixNode *a, const RadixNode *b, int level) {
+    static const RadixNode emptyNode;
+    static const uint8_t zeroPage[MEM_PAGE_SIZE] = {};
+    a = a ? a : &emptyNode;
+    b = b ? b : &emptyNode;
+    for (uint64_t i = 0; i < (1 << MEM_RADIX_BITS); i++) {
+        const void *slotA = a->slots[i].get();
+        const void *slotB = b->slots[i].get();
+        if (slotA == slotB) {
+            continue;
+        }
+        if (level > 0) {
+            if (!sameSlots(static_cast<const RadixNode *>(slotA),
+                           static_cast<const RadixNode *>(slotB), level - 1)) {
+                return false;
+            }
+        } else if (std::memcmp(slotA ? slotA : zeroPage, slotB ? slotB : zeroPage, MEM_PAGE_SIZE) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MemoryStore::sameContents(const MemoryStore &other) const {
+    return sameSlots(&root, &other.root, numLevels - 1);
+}
+
+int MemoryStore::writeBytes(uint64_t address, const uint8_t *bytes, uint64_t length) {
+    uint64_t relativeAddr = address - startAddr;
+    if (relativeAddr > numEntries || numEntries - relativeAddr < length) {
+        std::cerr << LOG_ERROR << "Access violation writing 0x" << std::hex << length
+                  << " bytes at address 0x" << address << std::dec << std::endl;
+        return -EINVAL;
+    }
+
+    while (length > 0) {
+        uint64_t offset = relativeAddr & (MEM_PAGE_SIZE - 1);
+        uint64_t chunk = std::min<uint64_t>(length, MEM_PAGE_SIZE - offset);
+        if (bytes) {
+            std::memcpy(findPage(relativeAddr >> MEM_PAGE_BITS, true) + offset, bytes, chunk);
+            bytes += chunk;
+        } else if (findPage(relativeAddr >> MEM_PAGE_BITS, false)) {
+            // pages never written already read as 0s
+            std::memset(findPage(relativeAddr >> MEM_PAGE_BITS, true) + offset, 0, chunk);
+        }
+        relativeAddr += chunk;
+        length -= chunk;
+    }
+    return 0;
 }
 
 int MemoryStore::loadFromFile(const char *fileName) {
@@ -102,18 +376,22 @@ int MemoryStore::loadFromFile(const char *fileName) {
     if (infile) {
         // Get length of the file and read instruction file into a buffer
         infile.seekg(0, std::ios::end);
-        int length = infile.tellg();
+        std::streamoff length = infile.tellg();
         infile.seekg(0, std::ios::beg);
 
-        char *buf = new char[length];
-        infile.read(buf, length);
+        std::vector<uint8_t> buf(length);
+        infile.read(reinterpret_cast<char *>(buf.data()), length);
         infile.close();
 
-        // Initialize memory store with buffer contents
-        int memLength = length / sizeof(buf[0]);
-        int i;
-        for (i = 0; i < memLength; i++) {
-            this->setMemValue(i * BYTE_SIZE, buf[i], BYTE_SIZE);
+        // Initialize memory store with buffer contents, as much of them as fits
+        uint64_t fits = std::min<uint64_t>(buf.size(), numEntries);
+        if (writeBytes(0, buf.data(), fits) != 0) {
+            return ERROR;
+        }
+        if (fits < buf.size()) {
+            std::cerr << LOG_ERROR << "Memory file " << fileName << " is larger than memory, only the first 0x"
+                      << std::hex << fits << " bytes were loaded" << std::dec << std::endl;
+            return ERROR;
         }
         return SUCCESS;
     } else {
@@ -122,6 +400,31 @@ int MemoryStore::loadFromFile(const char *fileName) {
     }
 }
 
+// "00" to "ff", so formatting a byte is a single 2-byte copy
+static const struct HexTable {
+    char pairs[256][2];
+    HexTable() {
+        const char digits[] = "0123456789abcdef";
+        for (int i = 0; i < 256; i++) {
+            pairs[i][0] = digits[i >> 4];
+            pairs[i][1] = digits[i & 0xF];
+        }
+    }
+} hexTable;
+
+static inline void appendHexByte(std::string &buf, uint8_t byte) { buf.append(hexTable.pairs[byte], 2); }
+
+// value in lowercase hex, zero-padded to minDigits like std::hex with std::setw
+static void appendHex(std::string &buf, uint64_t value, int minDigits) {
+    int digits = minDigits;
+    while (digits < 16 && (value >> (digits * 4)) != 0) {
+        digits++;
+    }
+    for (int shift = (digits - 1) * 4; shift >= 0; shift -= 4) {
+        buf += "0123456789abcdef"[(value >> shift) & 0xF];
+    }
+}
+
 int MemoryStore::printMemArray(uint64_t startAddr, uint64_t endAddr, uint64_t entrySize,
                                uint64_t entriesPerRow, std::ostream &out_stream) {
     // Validate the entry size
@@ -140,32 +443,90 @@ int MemoryStore::printMemArray(uint64_t startAddr, uint64_t endAddr, uint64_t en
     uint64_t relEnd = endAddr - this->startAddr;
     uint64_t curAddr = startAddr;
 
-    try {
-        while (relStart < relEnd) {
-            out_stream << "0x" << std::hex << std::setfill('0') << std::setw(WORD_WIDTH) << curAddr << ": ";
-            for (uint64_t i = 0; i < entriesPerRow; i++) {
-                if (relStart < relEnd) {
-                    out_stream << "0x";
-                    for (int j = 0; j < (int)(entrySize); j++) {
-                        out_stream << std::hex << std::setfill('0') << std::setw(BYTE_WIDTH)
-                                   << (uint64_t)(memArr.at(relStart + j));
+    // the rows are formatted into one buffer that is written out at once
+    std::string buf;
+    if (relStart < relEnd && relEnd - relStart <= numEntries) {
+        uint64_t numRows = (relEnd - relStart) / (entrySize * entriesPerRow) + 1;
+        buf.reserve(numRows * (WORD_WIDTH + 5 + entriesPerRow * (2 * entrySize + 3)));
+    }
+    uint64_t pageNumber = ~0ULL;
+    const uint8_t *page = nullptr;
+
+    while (relStart < relEnd) {
+        buf += "0x";
+        appendHex(buf, curAddr, WORD_WIDTH);
+        buf += ": ";
+        for (uint64_t i = 0; i < entriesPerRow; i++) {
+            if (relStart < relEnd) {
+                if (relStart >= numEntries || numEntries - relStart < entrySize) {
+                    out_stream.write(buf.data(), buf.size());
+                    std::cerr << LOG_ERROR << "Access violation at address 0x" << std::hex << curAddr << std::endl;
+                    return -EINVAL;
+                }
+                buf += "0x";
+                for (int j = 0; j < (int)(entrySize); j++) {
+                    if (((relStart + j) >> MEM_PAGE_BITS) != pageNumber) {
+                        pageNumber = (relStart + j) >> MEM_PAGE_BITS;
+                        page = findPage(pageNumber, false);
                     }
-                    relStart += entrySize;
-                    out_stream << " ";
-                } else {
-                    out_stream << std::endl;
-                    return 0;
+                    appendHexByte(buf, page ? page[(relStart + j) & (MEM_PAGE_SIZE - 1)] : 0);
                 }
+                relStart += entrySize;
+                buf += ' ';
+            } else {
+                buf += '\n';
+                out_stream.write(buf.data(), buf.size());
+                return 0;
             }
-
-            out_stream << std::endl;
-            curAddr += (uint64_t)(entrySize)*entriesPerRow;
         }
-    } catch (const std::out_of_range &e) {
-        std::cerr << LOG_ERROR << "Access violation at address 0x" << std::hex << curAddr << std::endl;
+
+        buf += '\n';
+        curAddr += (uint64_t)(entrySize)*entriesPerRow;
+    }
+
+    out_stream.write(buf.data(), buf.size());
+    return 0;
+}
+
+// FNV-1a, enough to tell dumped pages apart
+static uint64_t checksum(const uint8_t *bytes, uint64_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (uint64_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+int MemoryStore::printMemBinary(uint64_t startAddr, uint64_t endAddr, std::ostream &out_stream,
+                                std::ostream &manifest) {
+    uint64_t relStart = startAddr - this->startAddr;
+    uint64_t relEnd = endAddr - this->startAddr;
+    if (relStart > relEnd || relEnd > numEntries) {
+        std::cerr << LOG_ERROR << "Access violation dumping 0x" << std::hex << startAddr << " to 0x"
+                  << endAddr << std::dec << std::endl;
         return -EINVAL;
     }
 
+    static const uint8_t zeroPage[MEM_PAGE_SIZE] = {};
+    std::string lines;
+    while (relStart < relEnd) {
+        uint64_t offset = relStart & (MEM_PAGE_SIZE - 1);
+        uint64_t chunk = std::min<uint64_t>(relEnd - relStart, MEM_PAGE_SIZE - offset);
+        const uint8_t *page = findPage(relStart >> MEM_PAGE_BITS, false);
+        const uint8_t *bytes = (page ? page : zeroPage) + offset;
+        out_stream.write(reinterpret_cast<const char *>(bytes), chunk);
+
+        // one "<address> <length> <checksum>" line per page
+        lines += "0x";
+        appendHex(lines, relStart + this->startAddr, WORD_WIDTH);
+        lines += " 0x";
+        appendHex(lines, chunk, 1);
+        lines += " 0x";
+        appendHex(lines, checksum(bytes, chunk), 16);
+        lines += '\n';
+        relStart += chunk;
+    }
+    manifest.write(lines.data(), lines.size());
     return 0;
 }
 
@@ -173,6 +534,10 @@ int MemoryStore::printMemory(uint64_t startAddr, uint64_t endAddress) {
     return printMemArray(startAddr, endAddress, WORD_SIZE, 5, std::cout);
 }
 
+static bool binaryMemoryDump = false;
+
+void enableBinaryMemoryDump() { binaryMemoryDump = true; }
+
 void dumpMemoryState(MemoryStore *mem, const std::string &base_output_name) {
     uint64_t startAddr;
     uint64_t endAddr;
@@ -186,6 +551,18 @@ void dumpMemoryState(MemoryStore *mem, const std::string &base_output_name) {
         memRange >> std::hex >> startAddr;
         memRange >> std::hex >> endAddr;
     }
+
+    if (binaryMemoryDump) {
+        std::ofstream mem_out(base_output_name + "_mem_state.bin", std::ios::binary);
+        std::ofstream sums_out(base_output_name + "_mem_state.sums");
+        if (mem_out && sums_out) {
+            mem->printMemBinary(startAddr, endAddr, mem_out, sums_out);
+        } else {
+            std::cerr << LOG_ERROR << "Could not create memory state dump files" << std::endl;
+        }
+        return;
+    }
+
     std::ofstream mem_out(base_output_name + "_mem_state.out");
 
     if (mem_out) {
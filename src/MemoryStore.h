@@ -1,12 +1,20 @@
 #pragma once
 #include <inttypes.h>
 
+#include <memory>
 #include <string>
 #include <vector>
 
-// The memory is 64 KB large.
+// The memory is 64 KB large by default.
 #define MEMORY_SIZE 0x10000
 
+// Memory is allocated in pages of 2^MEM_PAGE_BITS bytes on first write and found
+// through a radix table with 2^MEM_RADIX_BITS entries per node. Pages are aligned
+// to their size, so after fork() a write to one dirties a single host page.
+#define MEM_PAGE_BITS 12
+#define MEM_PAGE_SIZE (1ULL << MEM_PAGE_BITS)
+#define MEM_RADIX_BITS 9
+
 #define BYTE_SHIFT 8
 #define BYTE_WIDTH 2
 #define WORD_WIDTH 8
@@ -19,22 +27,75 @@ enum MemEntrySize { BYTE_SIZE = 1, HALF_SIZE = 2, WORD_SIZE = 4, DOUBLE_SIZE = 8
 // values over a given address range.
 class MemoryStore {
    private:
+    struct RadixNode {
+        // child nodes, or pages in the last level; shared between clones until written
+        std::shared_ptr<void> slots[1 << MEM_RADIX_BITS];
+    };
+
     uint64_t startAddr;
-    std::vector<uint8_t> memArr;
+    // bytes mapped from startAddr on, accesses outside them are access violations
+    uint64_t numEntries;
+    // radix levels needed to index every page of the mapped range
+    int numLevels;
+    RadixNode root;
+    // pages this store allocated or copied
+    uint64_t ownedPages;
+    // one-entry cache of the most recently used page, lastPageWritable if it may be
+    // written in place
+    uint64_t lastPageNumber;
+    uint8_t* lastPage;
+    bool lastPageWritable;
+
+    // clones share every node and page with other
+    MemoryStore(const MemoryStore& other);
+    MemoryStore& operator=(const MemoryStore&) = delete;
 
-    int getOrSetValue(bool get, uint64_t address, uint64_t& value, MemEntrySize size);
+    void initPages();
+    // page holding page number (relative to startAddr), nullptr if never written and
+    // !write; write also makes the page and the nodes above it private to this store
+    uint8_t* findPage(uint64_t pageNumber, bool write);
+    void* ownSlot(std::shared_ptr<void>& slot, bool isPage);
+    // sameContents of the slots of two nodes at level, nullptr for an empty node
+    static bool sameSlots(const RadixNode* a, const RadixNode* b, int level);
+    template <bool get>
+    int getOrSetValue(uint64_t address, uint64_t& value, MemEntrySize size);
 
    public:
     MemoryStore(uint64_t startAddr, uint64_t numEntries);
     MemoryStore(uint64_t startAddr, uint64_t numEntries, const char* fileName);
     ~MemoryStore(){};
 
+    // Copy-on-write snapshot: the clone shares all pages with this store, and whichever
+    // of them writes a shared page first gets its own copy. Costs one radix node.
+    std::unique_ptr<MemoryStore> clone();
+
     int loadFromFile(const char* fileName);
     int getMemValue(uint64_t address, uint64_t& value, MemEntrySize size);
     int setMemValue(uint64_t address, uint64_t value, MemEntrySize size);
+    // copy length bytes to address one page at a time, or zero them if bytes is
+    // nullptr; fails without writing anything if the range is not fully mapped
+    int writeBytes(uint64_t address, const uint8_t* bytes, uint64_t length);
     int printMemory(uint64_t startAddress, uint64_t endAddress);
     int printMemArray(uint64_t startAddr, uint64_t endAddr, uint64_t entrySize,
                       uint64_t entriesPerRow, std::ostream& out_stream);
+    // raw bytes of [startAddr, endAddr) to out_stream, and an "<address> <length>
+    // <checksum>" line per page of them to manifest
+    int printMemBinary(uint64_t startAddr, uint64_t endAddr, std::ostream& out_stream,
+                       std::ostream& manifest);
+
+    // Host bytes of the page holding address, for callers that access memory directly:
+    // nullptr if the page is not wholly mapped, startAddr is not page aligned or, for
+    // !write, the page was never written. write makes the page private like a store.
+    // The bytes move when a page shared with a clone is written, so cache them only
+    // until the next setMemValue to the page.
+    uint8_t* pageBytes(uint64_t address, bool write);
+    // true if every mapped byte equals the one at the same address of other, which
+    // must be this store or a clone of it; shared nodes and pages are skipped
+    bool sameContents(const MemoryStore& other) const;
+
+    // bytes of pages this store allocated or copied, excluding pages still shared
+    // with the store it was cloned from
+    uint64_t getAllocatedBytes() { return ownedPages * MEM_PAGE_SIZE; }
 };
 
 // Creates a memory store.
@@ -43,4 +104,21 @@ class MemoryStore {
 // Dumps the section of memory relevant for the test.
 void dumpMemoryState(MemoryStore* mem, const std::string& base_output_name);
 
+// dumpMemoryState() writes the range raw to <output>_mem_state.bin and a checksum per
+// page to <output>_mem_state.sums instead of the text _mem_state.out
+void enableBinaryMemoryDump();
+
+// Initial memory images are either text, pairs of hex word address and value, or binary:
+// MEM_IMAGE_MAGIC and MEM_IMAGE_VERSION as uint32s followed by ranges of a uint64
+// address, a uint64 length and that many payload bytes, all little-endian.
+#define MEM_IMAGE_MAGIC 0x494d5652  // "RVMI"
+#define MEM_IMAGE_VERSION 1
+
+// Images prepareMemory() applies in order, init_mem_image in the working directory
+// by default (skipped if missing); false if one of the files can't be opened.
+bool setMemoryImages(const std::vector<std::string>& fileNames);
+
 int prepareMemory(MemoryStore* mem);
+
+// Parse a memory size in bytes given in decimal or 0x-prefixed hex.
+bool parseMemorySize(const char* text, uint64_t& size);
@@ -1,4 +1,5 @@
 #include "Utilities.h"
+#include "isa.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
@@ -9,184 +10,10 @@
 #include <iostream>
 #include <sstream>
 
+// mnemonic of an encoding, from the same tables the decoder uses
 static std::string getOpString(uint64_t opcode, uint64_t funct3, uint64_t funct7) {
-    std::string prefix = "", body = "", suffix = "";
-    switch (opcode) {
-        case OP_INTIMM:
-            suffix = "i";
-        case OP_INT:
-            switch (funct3) {
-                case FUNCT3_ADD:
-                    if (opcode == OP_INT) {
-                        switch (funct7) {
-                            case FUNCT7_ADD:
-                                body = "add";
-                                break;
-                            case FUNCT7_SUB:
-                                body = "sub";
-                                break;
-                            default:
-                                return "ILLEGAL";
-                        }
-                    } else {
-                        body = "add"; // There is no subi
-                    }
-                    break;
-                case FUNCT3_SLL:
-                    body = "sll";
-                    break;
-                case FUNCT3_SLT:
-                    body = "slt";
-                    break;
-                case FUNCT3_SLTU:
-                    body = "sltu";
-                    break;
-                case FUNCT3_XOR:
-                    body = "xor";
-                    break;
-                case FUNCT3_SR:
-                    switch (funct7 >> 1) {
-                        case UPPERIMM_LOGICAL:
-                            body = "srl";
-                            break;
-                        case UPPERIMM_ARITH:
-                            body = "sra";
-                            break;
-                        default:
-                            return "ILLEGAL";
-                    }
-                    break;
-                case FUNCT3_OR:
-                    body = "or";
-                    break;
-                case FUNCT3_AND:
-                    body = "and";
-                    break;
-                default:
-                    return "ILLEGAL";
-            }
-            break;
-        case OP_INTIMMW:
-            suffix = "i";
-        case OP_INTW:
-            suffix += "w";
-            switch (funct3) {
-                case FUNCT3_ADD:
-                    switch (funct7) {
-                        case FUNCT7_ADD:
-                            body = "add";
-                            break;
-                        case FUNCT7_SUB:
-                            body = "sub";
-                            break;
-                        default:
-                            return "ILLEGAL";
-                    }
-                    break;
-                case FUNCT3_SLL:
-                    body = "sll";
-                    break;
-                case FUNCT3_SR:
-                    switch (funct7) {
-                        case FUNCT7_LOGICAL:
-                            body = "srl";
-                            break;
-                        case FUNCT7_ARITH:
-                            body = "sra";
-                            break;
-                        default:
-                            return "ILLEGAL";
-                    }
-                    break;
-                default:
-                    return "ILLEGAL";
-            }
-            break;
-        case OP_LOAD:
-            prefix = "l";
-            switch (funct3) {
-                case FUNCT3_B:
-                    body = "b";
-                    break;
-                case FUNCT3_H:
-                    body = "h";
-                    break;
-                case FUNCT3_W:
-                    body = "w";
-                    break;
-                case FUNCT3_D:
-                    body = "d";
-                    break;
-                case FUNCT3_BU:
-                    body = "bu";
-                    break;
-                case FUNCT3_HU:
-                    body = "hu";
-                    break;
-                case FUNCT3_WU:
-                    body = "wu";
-                    break;
-                default:
-                    return "ILLEGAL";
-            }
-            break;
-        case OP_STORE:
-            prefix = "s";
-            switch (funct3) {
-                case FUNCT3_B:
-                    body = "b";
-                    break;
-                case FUNCT3_H:
-                    body = "h";
-                    break;
-                case FUNCT3_W:
-                    body = "w";
-                    break;
-                case FUNCT3_D:
-                    body = "d";
-                    break;
-                default:
-                    return "ILLEGAL";
-            }
-            break;
-        case OP_BRANCH:
-            prefix = "b";
-            switch (funct3) {
-                case FUNCT3_BEQ:
-                    body = "eq";
-                    break;
-                case FUNCT3_BNE:
-                    body = "ne";
-                    break;
-                case FUNCT3_BLT:
-                    body = "lt";
-                    break;
-                case FUNCT3_BGE:
-                    body = "ge";
-                    break;
-                case FUNCT3_BLTU:
-                    body = "ltu";
-                    break;
-                case FUNCT3_BGEU:
-                    body = "geu";
-                    break;
-                default:
-                    return "ILLEGAL";
-            }
-            break;
-        case OP_JAL:
-            return "jal";
-        case OP_JALR:
-            return "jalr";
-        case OP_LUI:
-            return "lui";
-        case OP_AUIPC:
-            return "auipc";
-        default:
-            return "ILLEGAL";
-    }
-
-    return prefix + body + suffix;
+    const char* mnemonic = lookupIsa(opcode, funct3, funct7).mnemonic;
+    return mnemonic ? mnemonic : "ILLEGAL";
 }
 
 // extract specific bits [start, end] from a 32 bit instruction
@@ -220,17 +47,12 @@ static void handleIAndR(uint64_t curInst, std::ostream &out_stream) {
 
     std::string opcodeStr = getOpString(opcode, funct3, funct7);
 
-    if (opcodeStr == "ILLEGAL") {
-        out_stream << " ILLEGAL";
-        return;
-    }
-
     std::ostringstream sb;
     if (opcode == OP_INT || opcode == OP_INTW) {
-        sb << " " << getOpString(opcode, funct3, funct7) << " " 
+        sb << " " << opcodeStr << " " 
         << regNames[rd] << ", " << regNames[rs1] << ", " << regNames[rs2];
     } else {
-        sb << " " << getOpString(opcode, funct3, funct7) << " " 
+        sb << " " << opcodeStr << " " 
         << regNames[rd] << ", " << regNames[rs1] << ", ";
         if (funct3 == FUNCT3_SLL || funct3 == FUNCT3_SR) {
             // For shift right, we need to handle the immediate differently
@@ -260,11 +82,6 @@ static void handleLAndS(uint64_t curInst, std::ostream &out_stream) {
 
     std::string opcodeStr = getOpString(opcode, funct3, 0);
 
-    if (opcodeStr == "ILLEGAL") {
-        out_stream << " ILLEGAL";
-        return;
-    }
-
     std::ostringstream sb;
     if (opcode == OP_LOAD) {
         sb << " " << opcodeStr << " " << regNames[rd] << ", " 
@@ -296,11 +113,6 @@ static void handleBranch(uint64_t curInst, std::ostream &out_stream) {
 
     std::string opcodeStr = getOpString(opcode, funct3, 0);
 
-    if (opcodeStr == "ILLEGAL") {
-        out_stream << " ILLEGAL";
-        return;
-    }
-
     std::ostringstream sb;
     sb << " " << opcodeStr << " " 
        << regNames[rs1] << ", " << regNames[rs2] 
@@ -324,11 +136,6 @@ static void handleSpecial(uint64_t curInst, std::ostream &out_stream) {
 
     std::string opcodeStr = getOpString(opcode, 0, 0);
 
-    if (opcodeStr == "ILLEGAL") {
-        out_stream << " ILLEGAL";
-        return;
-    }
-
     std::ostringstream sb;
     if (opcode == OP_JAL) {
         sb << " " << opcodeStr << " " << regNames[rd] << ", " 
@@ -363,34 +170,20 @@ static void printInstr(uint32_t curInst, StageStatus status, std::ostream &pipeS
         return;
     }
 
-    uint64_t opcode = extractBits(curInst, 6,  0);
-
-    switch (opcode) {
-        case OP_INT:
-        case OP_INTW:
-        case OP_INTIMM:
-        case OP_INTIMMW:
-        case OP_JALR:
-            handleIAndR(curInst, sb);
-            break;
-        case OP_LOAD:
-        case OP_STORE:
-            handleLAndS(curInst, sb);
-            break;
-        case OP_BRANCH:
-            handleBranch(curInst, sb);
-            break;
-        case OP_JAL:
-        case OP_LUI:
-        case OP_AUIPC:
-            handleSpecial(curInst, sb);
-            break;
-        default:
-            // Illegal instruction. Trigger an exception.
-            // Note: Since we catch illegal instructions here, the "handle"
-            // instructions don't need to check for illegal instructions.
-            // except for the case with a 0 opcode and illegal function.
-            sb << " ILLEGAL";
+    const IsaEntry& entry = lookupIsa(extractBits(curInst, 6, 0), extractBits(curInst, 14, 12),
+                                      extractBits(curInst, 31, 25));
+
+    if (!(entry.flags & ISA_LEGAL)) {
+        // Illegal instruction. Trigger an exception.
+        sb << " ILLEGAL";
+    } else if (entry.flags & (ISA_READS_MEM | ISA_WRITES_MEM)) {
+        handleLAndS(curInst, sb);
+    } else if (entry.format == FORMAT_B) {
+        handleBranch(curInst, sb);
+    } else if (entry.format == FORMAT_U || entry.format == FORMAT_J) {
+        handleSpecial(curInst, sb);
+    } else {
+        handleIAndR(curInst, sb);
     }
     sb << stageStatusStr.at(status);
     pipeState << std::left << std::setw(25) << sb.str();
@@ -436,6 +229,88 @@ Status dumpSimStats(SimulationStats &stats, const std::string &base_output_name)
         simStats << std::left << std::setw(23) << "D-cache hits: "        << stats.dcHits << std::endl;
         simStats << std::left << std::setw(23) << "D-cache misses: "      << stats.dcMisses << std::endl;
         simStats << std::left << std::setw(23) << "Load-use stalls: "     << stats.loadUseStalls << std::endl;
+        if (!stats.icPolicy.empty() || !stats.dcPolicy.empty()) {
+            simStats << std::left << std::setw(23) << "I-cache policy: "  << stats.icPolicy << std::endl;
+            simStats << std::left << std::setw(23) << "D-cache policy: "  << stats.dcPolicy << std::endl;
+        }
+        if (stats.dcWriteDetails) {
+            simStats << std::left << std::setw(23) << "D-cache read hits: "    << stats.dcReadHits << std::endl;
+            simStats << std::left << std::setw(23) << "D-cache read misses: "  << stats.dcReadMisses << std::endl;
+            simStats << std::left << std::setw(23) << "D-cache write hits: "   << stats.dcWriteHits << std::endl;
+            simStats << std::left << std::setw(23) << "D-cache write misses: " << stats.dcWriteMisses << std::endl;
+            simStats << std::left << std::setw(23) << "D-cache writebacks: "   << stats.dcWritebacks << std::endl;
+            simStats << std::left << std::setw(23) << "D-cache write-thrus: "   << stats.dcWriteThroughs << std::endl;
+        }
+        if (!stats.icPrefetcher.empty()) {
+            simStats << std::left << std::setw(23) << "I-prefetcher: "         << stats.icPrefetcher << std::endl;
+            simStats << std::left << std::setw(23) << "I-prefetch issued: "    << stats.icPrefetchIssued << std::endl;
+            simStats << std::left << std::setw(23) << "I-prefetch useful: "    << stats.icPrefetchUseful << std::endl;
+            simStats << std::left << std::setw(23) << "I-prefetch late: "      << stats.icPrefetchLate << std::endl;
+            simStats << std::left << std::setw(23) << "I-prefetch polluting: " << stats.icPrefetchPolluting << std::endl;
+        }
+        if (!stats.dcPrefetcher.empty()) {
+            simStats << std::left << std::setw(23) << "D-prefetcher: "         << stats.dcPrefetcher << std::endl;
+            simStats << std::left << std::setw(23) << "D-prefetch issued: "    << stats.dcPrefetchIssued << std::endl;
+            simStats << std::left << std::setw(23) << "D-prefetch useful: "    << stats.dcPrefetchUseful << std::endl;
+            simStats << std::left << std::setw(23) << "D-prefetch late: "      << stats.dcPrefetchLate << std::endl;
+            simStats << std::left << std::setw(23) << "D-prefetch polluting: " << stats.dcPrefetchPolluting << std::endl;
+        }
+        if (!stats.l2Policy.empty()) {
+            simStats << std::left << std::setw(23) << "L2 policy: "     << stats.l2Policy << std::endl;
+            simStats << std::left << std::setw(23) << "L2 hits: "       << stats.l2Hits << std::endl;
+            simStats << std::left << std::setw(23) << "L2 misses: "     << stats.l2Misses << std::endl;
+            simStats << std::left << std::setw(23) << "L2 writebacks: " << stats.l2Writebacks << std::endl;
+        }
+        if (!stats.l3Policy.empty()) {
+            simStats << std::left << std::setw(23) << "L3 policy: "     << stats.l3Policy << std::endl;
+            simStats << std::left << std::setw(23) << "L3 hits: "       << stats.l3Hits << std::endl;
+            simStats << std::left << std::setw(23) << "L3 misses: "     << stats.l3Misses << std::endl;
+            simStats << std::left << std::setw(23) << "L3 writebacks: " << stats.l3Writebacks << std::endl;
+        }
+        if (stats.dcMshrs > 0) {
+            simStats << std::left << std::setw(23) << "D-cache MSHRs: "        << stats.dcMshrs << std::endl;
+            simStats << std::left << std::setw(23) << "MSHR merges: "          << stats.dcMshrMerges << std::endl;
+            simStats << std::left << std::setw(23) << "MSHR full stalls: "     << stats.dcMshrFullStalls << std::endl;
+            simStats << std::left << std::setw(23) << "MSHR avg occupancy: "   << std::fixed << std::setprecision(2)
+                     << stats.dcMshrAvgOccupancy << std::endl;
+            simStats << std::left << std::setw(23) << "MSHR max occupancy: "   << stats.dcMshrMaxOccupancy << std::endl;
+            simStats << std::left << std::setw(23) << "Miss-use stalls: "      << stats.missUseStalls << std::endl;
+        }
+        if (stats.icVictimEntries > 0) {
+            simStats << std::left << std::setw(23) << "I-victim entries: "     << stats.icVictimEntries << std::endl;
+            simStats << std::left << std::setw(23) << "I-victim hits: "        << stats.icVictimHits << std::endl;
+            simStats << std::left << std::setw(23) << "I-victim swaps: "       << stats.icVictimSwaps << std::endl;
+        }
+        if (stats.dcVictimEntries > 0) {
+            simStats << std::left << std::setw(23) << "D-victim entries: "     << stats.dcVictimEntries << std::endl;
+            simStats << std::left << std::setw(23) << "D-victim hits: "        << stats.dcVictimHits << std::endl;
+            simStats << std::left << std::setw(23) << "D-victim swaps: "       << stats.dcVictimSwaps << std::endl;
+        }
+        if (stats.dramReads + stats.dramWrites > 0) {
+            uint64_t dramAccesses = stats.dramReads + stats.dramWrites;
+            simStats << std::left << std::setw(23) << "DRAM reads: "          << stats.dramReads << std::endl;
+            simStats << std::left << std::setw(23) << "DRAM writes: "         << stats.dramWrites << std::endl;
+            simStats << std::left << std::setw(23) << "DRAM row hit rate: "   << std::fixed << std::setprecision(2)
+                     << (double)stats.dramRowHits / dramAccesses << std::endl;
+            simStats << std::left << std::setw(23) << "DRAM bank conflicts: " << stats.dramBankConflicts << std::endl;
+            simStats << std::left << std::setw(23) << "DRAM bytes/cycle: "    << std::fixed << std::setprecision(2)
+                     << stats.dramBandwidth << std::endl;
+        }
+        if (stats.missClassification) {
+            auto printClasses = [&](const char* name, const MissClasses& classes) {
+                simStats << std::left << std::setw(23) << std::string(name) + " compulsory: " << classes.compulsory << std::endl;
+                simStats << std::left << std::setw(23) << std::string(name) + " capacity: "   << classes.capacity << std::endl;
+                simStats << std::left << std::setw(23) << std::string(name) + " conflict: "   << classes.conflict << std::endl;
+            };
+            printClasses("I-cache", stats.icMissClasses);
+            printClasses("D-cache", stats.dcMissClasses);
+            if (!stats.l2Policy.empty()) {
+                printClasses("L2", stats.l2MissClasses);
+            }
+            if (!stats.l3Policy.empty()) {
+                printClasses("L3", stats.l3MissClasses);
+            }
+        }
         return SUCCESS;
     } else {
         std::cerr << LOG_ERROR << "Could not open sim stats file!" << std::endl;
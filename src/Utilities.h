@@ -93,7 +93,7 @@ static const std::string regNames[NUM_REGS] = {
     "s9", "s10", "s11", "t3", "t4", "t5", "t6"
 };
 
-enum StageStatus {
+enum StageStatus : uint8_t {
     NORMAL = 0,
     BUBBLE,
     IDLE,
@@ -123,6 +123,13 @@ struct PipeState {
     uint64_t wbInstr;
 };
 
+// misses of one cache split into the 3Cs
+struct MissClasses {
+    uint64_t compulsory = 0;
+    uint64_t capacity = 0;
+    uint64_t conflict = 0;
+};
+
 struct SimulationStats {
     uint64_t dynamicInstructions;
     uint64_t totalCycles;
@@ -131,6 +138,64 @@ struct SimulationStats {
     uint64_t dcHits;
     uint64_t dcMisses;
     uint64_t loadUseStalls;
+    // L1 replacement policies, only reported when set (cycle simulator, not all LRU)
+    std::string icPolicy;
+    std::string dcPolicy;
+    // D-cache write details, only reported for a write-through or no-write-allocate D-cache
+    bool dcWriteDetails = false;
+    uint64_t dcReadHits = 0;
+    uint64_t dcReadMisses = 0;
+    uint64_t dcWriteHits = 0;
+    uint64_t dcWriteMisses = 0;
+    uint64_t dcWritebacks = 0;
+    uint64_t dcWriteThroughs = 0;
+    // prefetchers, only reported when configured
+    std::string icPrefetcher;
+    uint64_t icPrefetchIssued = 0;
+    uint64_t icPrefetchUseful = 0;
+    uint64_t icPrefetchLate = 0;
+    uint64_t icPrefetchPolluting = 0;
+    std::string dcPrefetcher;
+    uint64_t dcPrefetchIssued = 0;
+    uint64_t dcPrefetchUseful = 0;
+    uint64_t dcPrefetchLate = 0;
+    uint64_t dcPrefetchPolluting = 0;
+    // lower cache levels, only reported when present
+    std::string l2Policy;
+    uint64_t l2Hits = 0;
+    uint64_t l2Misses = 0;
+    uint64_t l2Writebacks = 0;
+    std::string l3Policy;
+    uint64_t l3Hits = 0;
+    uint64_t l3Misses = 0;
+    uint64_t l3Writebacks = 0;
+    // lockup-free D-cache, only reported when it has MSHRs
+    uint64_t dcMshrs = 0;
+    uint64_t dcMshrMerges = 0;
+    uint64_t dcMshrFullStalls = 0;
+    double dcMshrAvgOccupancy = 0;
+    uint64_t dcMshrMaxOccupancy = 0;
+    uint64_t missUseStalls = 0;
+    // victim caches, only reported when configured
+    uint64_t icVictimEntries = 0;
+    uint64_t icVictimHits = 0;
+    uint64_t icVictimSwaps = 0;
+    uint64_t dcVictimEntries = 0;
+    uint64_t dcVictimHits = 0;
+    uint64_t dcVictimSwaps = 0;
+    // DRAM behind the last level, only reported when it had accesses
+    uint64_t dramReads = 0;
+    uint64_t dramWrites = 0;
+    uint64_t dramRowHits = 0;
+    uint64_t dramBankConflicts = 0;
+    // bytes per cycle
+    double dramBandwidth = 0;
+    // 3C miss classification, only reported when enabled
+    bool missClassification = false;
+    MissClasses icMissClasses;
+    MissClasses dcMissClasses;
+    MissClasses l2MissClasses;
+    MissClasses l3MissClasses;
 };
 
 // extract specific bits [start, end] from a 32 bit instruction
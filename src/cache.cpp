@@ -3,75 +3,797 @@
 
 #include "cache.h"
 #include <random>
-#include <list>
 #include <stdio.h>
 #include <algorithm>
+#include <fstream>
+#include <sstream>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TAG_MATCH_X86 1
+#endif
 
 using namespace std;
 
-// Random generator for cache hit/miss simulation
-static std::mt19937 generator(42);  // Fixed seed for deterministic results
-std::uniform_real_distribution<double> distribution(0.0, 1.0);
+static const char* policyNames[] = {"LRU", "PLRU", "FIFO", "RANDOM", "SRRIP", "BIP"};
 
-int numOffsetBits;
-int numIndexBits;
+const char* getPolicyName(ReplacementPolicy policy) {
+    return policyNames[policy];
+}
+
+bool parsePolicyName(const std::string& name, ReplacementPolicy& policy) {
+    std::string upper = name;
+    std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+    for (int i = REPL_LRU; i <= REPL_BIP; i++) {
+        if (upper == policyNames[i]) {
+            policy = static_cast<ReplacementPolicy>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// View of one set handed to the replacement policies below.
+struct CacheSet {
+    CacheLine* lines;
+    uint64_t ways;
+    uint64_t& plruBits;
+    uint64_t now;
+    std::mt19937& generator;
+};
+
+// Replacement policies. Each provides
+//   onHit(set, way):  update state after a hit on way
+//   onFill(set, way): update state after way was filled on a miss
+//   victim(set):      pick the way to evict from a full set
+// Invalid ways are always filled first, so victim() only sees full sets.
+
+// index of the valid way with the smallest lastUsed
+static uint64_t oldestWay(CacheSet& set) {
+    uint64_t oldest = 0;
+    for (uint64_t way = 1; way < set.ways; way++) {
+        if (set.lines[way].lastUsed < set.lines[oldest].lastUsed) {
+            oldest = way;
+        }
+    }
+    return oldest;
+}
+
+struct LruPolicy {
+    static void onHit(CacheSet& set, uint64_t way) { set.lines[way].lastUsed = set.now; }
+    static void onFill(CacheSet& set, uint64_t way) { set.lines[way].lastUsed = set.now; }
+    static uint64_t victim(CacheSet& set) { return oldestWay(set); }
+};
+
+struct FifoPolicy {
+    static void onHit(CacheSet&, uint64_t) {}
+    static void onFill(CacheSet& set, uint64_t way) { set.lines[way].lastUsed = set.now; }
+    static uint64_t victim(CacheSet& set) { return oldestWay(set); }
+};
+
+struct RandomPolicy {
+    static void onHit(CacheSet&, uint64_t) {}
+    static void onFill(CacheSet&, uint64_t) {}
+    static uint64_t victim(CacheSet& set) { return set.generator() % set.ways; }
+};
+
+// Tree pseudo-LRU. Node n of the tree (1-based, children 2n and 2n + 1) is
+// bit n of plruBits; a set bit means the next victim is in the right subtree.
+struct PlruPolicy {
+    static void onHit(CacheSet& set, uint64_t way) {
+        uint64_t node = 1;
+        for (uint64_t half = set.ways >> 1; half > 0; half >>= 1) {
+            bool right = way & half;
+            // point this node away from the way just used
+            if (right) {
+                set.plruBits &= ~(1ULL << node);
+            } else {
+                set.plruBits |= 1ULL << node;
+            }
+            node = 2 * node + right;
+        }
+    }
+    static void onFill(CacheSet& set, uint64_t way) { onHit(set, way); }
+    static uint64_t victim(CacheSet& set) {
+        uint64_t node = 1;
+        while (node < set.ways) {
+            node = 2 * node + ((set.plruBits >> node) & 1);
+        }
+        return node - set.ways;
+    }
+};
+
+// SRRIP-HP: fill with a long re-reference prediction, promote to near on a
+// hit, and evict the first way predicted to be re-referenced in the distant future.
+struct SrripPolicy {
+    static const uint8_t maxRrpv = 3;
+    static void onHit(CacheSet& set, uint64_t way) { set.lines[way].rrpv = 0; }
+    static void onFill(CacheSet& set, uint64_t way) { set.lines[way].rrpv = maxRrpv - 1; }
+    static uint64_t victim(CacheSet& set) {
+        while (true) {
+            for (uint64_t way = 0; way < set.ways; way++) {
+                if (set.lines[way].rrpv == maxRrpv) {
+                    return way;
+                }
+            }
+            for (uint64_t way = 0; way < set.ways; way++) {
+                set.lines[way].rrpv += 1;
+            }
+        }
+    }
+};
+
+// Bimodal insertion: LRU, except that fills go to the LRU position and
+// only one in bipThrottle fills is inserted at MRU.
+struct BipPolicy {
+    static const uint32_t bipThrottle = 32;
+    static void onHit(CacheSet& set, uint64_t way) { set.lines[way].lastUsed = set.now; }
+    static void onFill(CacheSet& set, uint64_t way) {
+        set.lines[way].lastUsed = (set.generator() % bipThrottle == 0) ? set.now : 0;
+    }
+    static uint64_t victim(CacheSet& set) { return oldestWay(set); }
+};
 
 // Constructor definition
-Cache::Cache(CacheConfig configParam, CacheDataType cacheType) : config(configParam) {
+Cache::Cache(CacheConfig configParam, CacheDataType cacheType) : generator(42), config(configParam) {
     // Here you can initialize other cache-specific attributes
     // For instance, if you had cache tables or other structures, initialize them here
-    uint64_t numSets = config.cacheSize / config.blockSize / config.ways; 
+    numSets = config.cacheSize / config.blockSize / config.ways; 
+    if (numSets == 0) {
+        numSets = 1;
+    }
     type = cacheType;
     numOffsetBits = log2(config.blockSize);
     numIndexBits = log2(numSets);
+    indexMask = numSets - 1;
     hits = 0;
     misses = 0;
+    readHits = 0;
+    readMisses = 0;
+    writeHits = 0;
+    writeMisses = 0;
+    writebacks = 0;
+    writeThroughs = 0;
+    invalidations = 0;
+    usefulPrefetches = 0;
+    pollutingPrefetches = 0;
+    victimHits = 0;
+    victimSwaps = 0;
+    lastHitPrefetched = false;
+    lastAllocated = true;
+    lastLatency = 0;
+    nextLevel = nullptr;
+    memory = nullptr;
+    accessCount = 0;
+    // all lines are allocated up front so access() never touches the heap
+    lines.assign(numSets * config.ways, CacheLine());
+    plruBits.assign(numSets, 0);
+    tags.assign(numSets * config.ways, INVALID_TAG);
+    setTagMatch(getBestTagMatch());
+    selectAccessLoop();
+    victimLines.assign(config.victimEntries, CacheLine());
+}
+
+// Tag match kernels: return the way of tags[0, ways) equal to tag, or ways
+// if there is none. Invalid ways hold INVALID_TAG so they never match.
+static uint64_t matchTagScalar(const uint64_t* tags, uint64_t ways, uint64_t tag) {
+    for (uint64_t way = 0; way < ways; way++) {
+        if (tags[way] == tag) {
+            return way;
+        }
+    }
+    return ways;
+}
+
+#ifdef TAG_MATCH_X86
+// SSE2 has no 64-bit compare: a lane matches when both of its 32-bit halves do
+static uint64_t matchTagSse2(const uint64_t* tags, uint64_t ways, uint64_t tag) {
+    __m128i key = _mm_set1_epi64x(tag);
+    uint64_t way = 0;
+    for (; way + 2 <= ways; way += 2) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(tags + way)), key);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+        if (mask) {
+            return way + __builtin_ctz(mask);
+        }
+    }
+    return way + matchTagScalar(tags + way, ways - way, tag);
+}
+
+__attribute__((target("avx2")))
+static uint64_t matchTagAvx2(const uint64_t* tags, uint64_t ways, uint64_t tag) {
+    __m256i key = _mm256_set1_epi64x(tag);
+    uint64_t way = 0;
+    for (; way + 4 <= ways; way += 4) {
+        __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(tags + way)), key);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+        if (mask) {
+            return way + __builtin_ctz(mask);
+        }
+    }
+    // scalar tail: calling the SSE2 kernel from here would mix VEX and legacy SSE code
+    for (; way < ways; way++) {
+        if (tags[way] == tag) {
+            return way;
+        }
+    }
+    return ways;
+}
+#endif
+
+static const char* tagMatchNames[] = {"scalar", "SSE2", "AVX2"};
+
+const char* getTagMatchName(TagMatchKernel kernel) {
+    return tagMatchNames[kernel];
+}
+
+bool isTagMatchSupported(TagMatchKernel kernel) {
+#ifdef TAG_MATCH_X86
+    if (kernel == TAG_MATCH_AVX2) {
+        return __builtin_cpu_supports("avx2");
+    }
+    return true;
+#else
+    return kernel == TAG_MATCH_SCALAR;
+#endif
+}
+
+TagMatchKernel getBestTagMatch() {
+    if (isTagMatchSupported(TAG_MATCH_AVX2)) {
+        return TAG_MATCH_AVX2;
+    }
+    return isTagMatchSupported(TAG_MATCH_SSE2) ? TAG_MATCH_SSE2 : TAG_MATCH_SCALAR;
+}
+
+bool Cache::setTagMatch(TagMatchKernel kernel) {
+    if (!isTagMatchSupported(kernel)) {
+        return false;
+    }
+    tagMatchKernel = kernel;
+    matchTag = matchTagScalar;
+#ifdef TAG_MATCH_X86
+    if (kernel == TAG_MATCH_SSE2) {
+        matchTag = matchTagSse2;
+    } else if (kernel == TAG_MATCH_AVX2) {
+        matchTag = matchTagAvx2;
+    }
+#endif
+    return true;
+}
+
+// way a new block goes to: the first invalid way, else the policy's victim
+template <class Policy>
+static uint64_t fillWay(CacheSet& set) {
+    for (uint64_t way = 0; way < set.ways; way++) {
+        if (!set.lines[way].valid) {
+            return way;
+        }
+    }
+    return Policy::victim(set);
+}
+
+// Call fn with an instance of the policy struct selected by policy, so that
+// fn can instantiate a loop specialized for it.
+template <class Fn>
+static auto withPolicy(ReplacementPolicy policy, Fn fn) -> decltype(fn(LruPolicy())) {
+    switch (policy) {
+        case REPL_PLRU:
+            return fn(PlruPolicy());
+        case REPL_FIFO:
+            return fn(FifoPolicy());
+        case REPL_RANDOM:
+            return fn(RandomPolicy());
+        case REPL_SRRIP:
+            return fn(SrripPolicy());
+        case REPL_BIP:
+            return fn(BipPolicy());
+        case REPL_LRU:
+        default:
+            return fn(LruPolicy());
+    }
+}
+
+// Geometries of the access loop. DynamicGeometry reads the block offset and
+// way count of the instance, FixedGeometry makes them compile-time constants
+// so the shifts and the unrolled tag compare need no loads.
+struct DynamicGeometry {
+    static const bool isFixed = false;
+    static int offsetBits(int runtimeBits) { return runtimeBits; }
+    static uint64_t ways(uint64_t runtimeWays) { return runtimeWays; }
+};
+
+template <int OffsetBits, uint64_t Ways>
+struct FixedGeometry {
+    static const bool isFixed = true;
+    static int offsetBits(int) { return OffsetBits; }
+    static uint64_t ways(uint64_t) { return Ways; }
+};
+
+template <int OffsetBits, class Fn>
+static auto withWays(uint64_t ways, Fn fn) -> decltype(fn(DynamicGeometry())) {
+    switch (ways) {
+        case 1:
+            return fn(FixedGeometry<OffsetBits, 1>());
+        case 2:
+            return fn(FixedGeometry<OffsetBits, 2>());
+        case 4:
+            return fn(FixedGeometry<OffsetBits, 4>());
+        case 8:
+            return fn(FixedGeometry<OffsetBits, 8>());
+        default:
+            return fn(DynamicGeometry());
+    }
+}
+
+// Call fn with the geometry for config: fixed for 16, 32 and 64 byte blocks
+// with up to 8 ways, dynamic otherwise.
+template <class Fn>
+static auto withGeometry(const CacheConfig& config, Fn fn) -> decltype(fn(DynamicGeometry())) {
+    switch (config.blockSize) {
+        case 16:
+            return withWays<4>(config.ways, fn);
+        case 32:
+            return withWays<5>(config.ways, fn);
+        case 64:
+            return withWays<6>(config.ways, fn);
+        default:
+            return fn(DynamicGeometry());
+    }
+}
+
+bool Cache::usesTagMatch(const CacheConfig& config) {
+    return withGeometry(config, [&](auto geometry) {
+        return !decltype(geometry)::isFixed || config.ways > INLINE_TAG_MATCH_WAYS;
+    });
+}
+
+// pick the access loop for the policy and geometry of this instance once
+void Cache::selectAccessLoop() {
+    accessFn = withGeometry(config, [&](auto geometry) {
+        return withPolicy(config.policy, [&](auto policy) {
+            return &Cache::accessWith<decltype(policy), decltype(geometry)>;
+        });
+    });
 }
 
 // Access method definition
-bool Cache::access(uint64_t address, CacheOperation readWrite) {
+bool Cache::access(uint64_t address, CacheOperation readWrite, uint64_t pc) {
+    bool hit = (this->*accessFn)(address, readWrite);
+    if (classifier) {
+        classifier->access(address >> numOffsetBits, hit, lastAllocated);
+    }
+    if (attribution) {
+        uint64_t index = getIndex(address);
+        MissAttribution::PcCounts& counts = attribution->pcCounts[pc];
+        counts.accesses += 1;
+        if (hit) {
+            attribution->setHits[index] += 1;
+        } else {
+            attribution->setMisses[index] += 1;
+            counts.misses += 1;
+        }
+    }
+    return hit;
+}
+
+void Cache::enableMissAttribution() {
+    attribution.reset(new MissAttribution());
+    attribution->setHits.assign(numSets, 0);
+    attribution->setMisses.assign(numSets, 0);
+}
+
+void Cache::enableMissClassification() {
+    classifier.reset(new MissClassifier(numSets * config.ways));
+}
+
+bool Cache::prefetch(uint64_t address, uint64_t& fillLatency) {
+    return withPolicy(config.policy, [&](auto policy) {
+        return this->prefetchWith<decltype(policy)>(address, fillLatency);
+    });
+}
+
+template <class Policy, class Geometry>
+bool Cache::accessWith(uint64_t address, CacheOperation readWrite) {
+    uint64_t ways = Geometry::ways(config.ways);
+    uint64_t block = address >> Geometry::offsetBits(numOffsetBits);
+    uint64_t index = block & indexMask;
+    uint64_t tag = block >> numIndexBits;
+    bool isWrite = (readWrite == CACHE_WRITE);
+    accessCount += 1;
+    lastLatency = 0;
+    lastHitPrefetched = false;
+    lastAllocated = true;
+    CacheSet set{&lines[index * ways], ways, plruBits[index], accessCount, generator};
+
+    // under write-through every store also goes to the next level
+    if (isWrite && !config.writeBack) {
+        writeThroughs += 1;
+        lastLatency += config.writeLatency;
+        writeNextLevel(address);
+    }
+
+    // with a small constant way count the scalar compare unrolls completely
+    uint64_t way = (Geometry::isFixed && ways <= INLINE_TAG_MATCH_WAYS)
+                       ? matchTagScalar(&tags[index * ways], ways, tag)
+                       : matchTag(&tags[index * ways], ways, tag);
+    if (way < ways) {
+        CacheLine& line = set.lines[way];
+        Policy::onHit(set, way);
+        if (isWrite) {
+            line.dirty = line.dirty || config.writeBack;
+            writeHits += 1;
+        } else {
+            readHits += 1;
+        }
+        if (line.prefetched) {
+            line.prefetched = false;
+            lastHitPrefetched = true;
+            usefulPrefetches += 1;
+        }
+        hits += 1;
+        return true;
+    }
+
+    misses += 1;
+    if (!prefetchVictims.empty() && prefetchVictims.erase(getBlockAddress(index, tag))) {
+        pollutingPrefetches += 1;
+    }
+    if (!victimLines.empty() && swapVictim<Policy>(set, index, tag, isWrite)) {
+        victimHits += 1;
+        lastLatency += config.victimLatency;
+        if (isWrite) {
+            writeMisses += 1;
+        } else {
+            readMisses += 1;
+        }
+        return false;
+    }
+    if (isWrite) {
+        writeMisses += 1;
+        lastLatency += config.storeMissLatency;
+        if (!config.writeAllocate) {
+            // the store only updates the next level, write-back included
+            lastAllocated = false;
+            if (config.writeBack) {
+                writeThroughs += 1;
+                lastLatency += config.writeLatency;
+                writeNextLevel(address);
+            }
+            return false;
+        }
+    } else {
+        readMisses += 1;
+        lastLatency += config.missLatency;
+    }
+
+    fill<Policy>(set, index, tag, isWrite && config.writeBack, false);
+    return false;
+}
+
+template <class Policy>
+bool Cache::prefetchWith(uint64_t address, uint64_t& fillLatency) {
     uint64_t index = getIndex(address);
-    // cout << "index: "  << index << endl;
     uint64_t tag = getTag(address);
-    auto cacheSet = cacheTable.find(index);
-    cout << "getTag: "  << tag << endl;
-    if (cacheSet == cacheTable.end()) {
-        misses += 1;
-        list<uint64_t> set = {tag};
-        cacheTable.insert({index, set});
-        cout << "miss: "  << address << endl;
+    if (matchTag(&tags[index * config.ways], config.ways, tag) < config.ways) {
         return false;
     }
-    cout << "line 44 in cache.cpp " << endl;
-    auto set = cacheSet->second;
-    auto element = std::find(set.begin(), set.end(), tag);
-    if (element == set.end()) {
-        misses += 1;
-        if (set.size() < config.ways) {
-            set.push_back(tag);
+    CacheLine* lines = &this->lines[index * config.ways];
+    for (CacheLine& entry : victimLines) {
+        if (entry.valid && entry.tag == getBlockAddress(index, tag)) {
+            return false;
+        }
+    }
+
+    // prefetches do not advance the LRU clock or change lastLatency,
+    // the demand access they were triggered by already did
+    uint64_t demandLatency = lastLatency;
+    lastLatency = config.missLatency;
+    CacheSet set{lines, config.ways, plruBits[index], accessCount, generator};
+    prefetchVictims.erase(getBlockAddress(index, tag));
+    fill<Policy>(set, index, tag, false, true);
+    fillLatency = lastLatency;
+    lastLatency = demandLatency;
+    return true;
+}
+
+// Bring the block (index, tag) into its set after a miss, fetching it from
+// the next level and evicting a victim if the set is full. Adds the fetch and
+// any writeback to lastLatency.
+template <class Policy>
+void Cache::fill(CacheSet& set, uint64_t index, uint64_t tag, bool dirty, bool isPrefetch) {
+    // fetch the block from the next level first: an inclusive next level may
+    // back-invalidate lines of this set while making room for it
+    if (nextLevel) {
+        nextLevel->access(getBlockAddress(index, tag), CACHE_READ);
+        lastLatency += nextLevel->getLastLatency();
+    } else if (memory) {
+        lastLatency += memory->access(getBlockAddress(index, tag), false, config.blockSize);
+    }
+
+    uint64_t way = fillWay<Policy>(set);
+    CacheLine& line = set.lines[way];
+    bool writeVictim = false;
+    uint64_t victimAddress = 0;
+    if (line.valid) {
+        victimAddress = getBlockAddress(index, line.tag);
+        writeVictim = line.dirty;
+        if (isPrefetch) {
+            prefetchVictims.insert(victimAddress);
+        }
+        // with a victim cache the line moves there and only what it displaces leaves
+        bool leaves = victimLines.empty() || insertVictim(victimAddress, writeVictim);
+        // an inclusive cache may not drop a block its upper levels still hold
+        if (leaves && config.inclusive) {
+            for (Cache* upper : upperLevels) {
+                writeVictim = upper->invalidate(victimAddress, config.blockSize) || writeVictim;
+            }
+        }
+    }
+    line.tag = tag;
+    line.valid = true;
+    line.dirty = dirty;
+    line.prefetched = isPrefetch;
+    tags[index * config.ways + way] = tag;
+    Policy::onFill(set, way);
+
+    if (writeVictim) {
+        writebacks += 1;
+        lastLatency += config.writeLatency;
+        writeNextLevel(victimAddress);
+    }
+}
+
+// On a miss, move the block (index, tag) from the victim cache back into its
+// set, swapping in the line it displaces. Returns false if the victim cache
+// does not hold the block.
+template <class Policy>
+bool Cache::swapVictim(CacheSet& set, uint64_t index, uint64_t tag, bool isWrite) {
+    uint64_t blockAddress = getBlockAddress(index, tag);
+    for (CacheLine& entry : victimLines) {
+        if (!entry.valid || entry.tag != blockAddress) {
+            continue;
+        }
+        uint64_t way = fillWay<Policy>(set);
+        CacheLine& line = set.lines[way];
+        bool dirty = entry.dirty || (isWrite && config.writeBack);
+        if (line.valid) {
+            entry.tag = getBlockAddress(index, line.tag);
+            entry.dirty = line.dirty;
+            entry.lastUsed = accessCount;
+            victimSwaps += 1;
         } else {
-            cout << "cache set is full, removing: "  << set.front() << endl;
-            set.pop_front();
-            set.push_back(tag);
-        } 
-        cacheTable[index] = set;
-        cout << "miss: "  << address << endl;
-        cacheTable[index] = set;
-        return false;
-    } else {
-        set.remove(tag);
-        set.push_back(tag);
-        hits += 1;
-        cout << "hit: "  << address << endl;
-        cacheTable[index] = set;
+            entry.valid = false;
+            entry.dirty = false;
+        }
+        line.tag = tag;
+        line.valid = true;
+        line.dirty = dirty;
+        line.prefetched = false;
+        tags[index * config.ways + way] = tag;
+        Policy::onFill(set, way);
         return true;
     }
+    return false;
+}
+
+// Put a line evicted from its set into the least recently inserted victim
+// entry. Returns true if that displaced a valid entry, which then leaves this
+// level: blockAddress and dirty are replaced by the displaced line's.
+bool Cache::insertVictim(uint64_t& blockAddress, bool& dirty) {
+    CacheLine* slot = &victimLines[0];
+    for (CacheLine& entry : victimLines) {
+        if (!entry.valid) {
+            slot = &entry;
+            break;
+        }
+        if (entry.lastUsed < slot->lastUsed) {
+            slot = &entry;
+        }
+    }
+    bool displaced = slot->valid;
+    uint64_t displacedAddress = slot->tag;
+    bool displacedDirty = slot->dirty;
+    slot->tag = blockAddress;
+    slot->dirty = dirty;
+    slot->valid = true;
+    slot->lastUsed = accessCount;
+    blockAddress = displacedAddress;
+    dirty = displaced && displacedDirty;
+    return displaced;
+}
+
+// Posted writes (write-through stores, writebacks) update the next level but
+// do not add its latency, they are assumed to drain through a write buffer.
+void Cache::writeNextLevel(uint64_t address) {
+    if (nextLevel) {
+        nextLevel->access(address, CACHE_WRITE);
+    } else if (memory) {
+        memory->access(address, true, config.blockSize);
+    }
+}
+
+void Cache::setNextLevel(Cache* next) {
+    nextLevel = next;
+    next->upperLevels.push_back(this);
+}
+
+bool Cache::invalidate(uint64_t address, uint64_t size) {
+    bool dropped = false;
+    for (uint64_t blockAddress = address; blockAddress < address + size;
+         blockAddress += config.blockSize) {
+        uint64_t index = getIndex(blockAddress);
+        uint64_t tag = getTag(blockAddress);
+        uint64_t way = matchTag(&tags[index * config.ways], config.ways, tag);
+        if (way < config.ways) {
+            CacheLine& line = lines[index * config.ways + way];
+            dropped = dropped || line.dirty;
+            line.valid = false;
+            line.dirty = false;
+            tags[index * config.ways + way] = INVALID_TAG;
+            invalidations += 1;
+        }
+    }
+    for (CacheLine& entry : victimLines) {
+        if (entry.valid && entry.tag < address + size && entry.tag + config.blockSize > address) {
+            dropped = dropped || entry.dirty;
+            entry.valid = false;
+            entry.dirty = false;
+            invalidations += 1;
+        }
+    }
+    // levels above may hold the block even if this one does not
+    for (Cache* upper : upperLevels) {
+        dropped = upper->invalidate(address, size) || dropped;
+    }
+    return dropped;
+}
+
+// Checkpoint fields are written in host byte order.
+template <class T>
+static void writeValue(std::ostream& out, T value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <class T>
+static bool readValue(std::istream& in, T& value) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+static void writeLines(std::ostream& out, const std::vector<CacheLine>& lines) {
+    for (const CacheLine& line : lines) {
+        uint8_t flags = line.valid | (line.dirty << 1) | (line.prefetched << 2);
+        writeValue(out, line.tag);
+        writeValue(out, line.lastUsed);
+        writeValue(out, line.rrpv);
+        writeValue(out, flags);
+    }
+}
+
+static bool readLines(std::istream& in, std::vector<CacheLine>& lines) {
+    for (CacheLine& line : lines) {
+        uint8_t flags;
+        if (!readValue(in, line.tag) || !readValue(in, line.lastUsed) ||
+            !readValue(in, line.rrpv) || !readValue(in, flags)) {
+            return false;
+        }
+        line.valid = flags & 1;
+        line.dirty = flags & 2;
+        line.prefetched = flags & 4;
+    }
+    return true;
+}
+
+// Layout: magic, version, cacheSize, blockSize, ways, victimEntries, policy,
+// accessCount, the lines, the PLRU bits, the victim lines, then the generator
+// state as a length-prefixed string.
+Status Cache::saveState(const std::string& fileName) {
+    std::ofstream out(fileName, std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!out) {
+        cerr << LOG_ERROR << "Could not create cache state file " << fileName << endl;
+        return ERROR;
+    }
+    writeValue<uint32_t>(out, CACHE_STATE_MAGIC);
+    writeValue<uint32_t>(out, CACHE_STATE_VERSION);
+    writeValue<uint64_t>(out, config.cacheSize);
+    writeValue<uint64_t>(out, config.blockSize);
+    writeValue<uint64_t>(out, config.ways);
+    writeValue<uint64_t>(out, config.victimEntries);
+    writeValue<uint32_t>(out, config.policy);
+    writeValue<uint32_t>(out, config.writeBack);
+    writeValue<uint32_t>(out, config.writeAllocate);
+    writeValue<uint32_t>(out, config.inclusive);
+    writeValue<uint64_t>(out, accessCount);
+    writeLines(out, lines);
+    for (uint64_t bits : plruBits) {
+        writeValue(out, bits);
+    }
+    writeLines(out, victimLines);
+    std::ostringstream generatorState;
+    generatorState << generator;
+    writeValue<uint64_t>(out, generatorState.str().size());
+    out << generatorState.str();
+
+    if (!out) {
+        cerr << LOG_ERROR << "Could not write cache state file " << fileName << endl;
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+Status Cache::loadState(const std::string& fileName) {
+    std::ifstream in(fileName, std::ios::binary | std::ios::in);
+    if (!in) {
+        cerr << LOG_ERROR << "Could not open cache state file " << fileName << endl;
+        return ERROR;
+    }
+    uint32_t magic = 0, version = 0, policy = 0, writeBack = 0, writeAllocate = 0, inclusive = 0;
+    uint64_t cacheSize = 0, blockSize = 0, ways = 0, victimEntries = 0;
+    if (!readValue(in, magic) || magic != CACHE_STATE_MAGIC || !readValue(in, version)) {
+        cerr << LOG_ERROR << fileName << " is not a cache state file" << endl;
+        return ERROR;
+    }
+    if (version != CACHE_STATE_VERSION) {
+        cerr << LOG_ERROR << fileName << " has cache state version " << version << ", expected "
+             << CACHE_STATE_VERSION << endl;
+        return ERROR;
+    }
+    if (!readValue(in, cacheSize) || !readValue(in, blockSize) || !readValue(in, ways) ||
+        !readValue(in, victimEntries) || !readValue(in, policy) || !readValue(in, writeBack) ||
+        !readValue(in, writeAllocate) || !readValue(in, inclusive)) {
+        cerr << LOG_ERROR << "Truncated cache state file " << fileName << endl;
+        return ERROR;
+    }
+    if (cacheSize != config.cacheSize || blockSize != config.blockSize || ways != config.ways ||
+        victimEntries != config.victimEntries || policy != (uint32_t)config.policy ||
+        writeBack != (uint32_t)config.writeBack || writeAllocate != (uint32_t)config.writeAllocate ||
+        inclusive != (uint32_t)config.inclusive) {
+        cerr << LOG_ERROR << fileName << " was saved from a different cache: " << cacheSize << " bytes, "
+             << blockSize << " byte blocks, " << ways << " ways, " << victimEntries
+             << " victim entries, policy " << (policy <= REPL_BIP ? policyNames[policy] : "?") << ", "
+             << (writeBack ? "write-back" : "write-through") << ", "
+             << (writeAllocate ? "write-allocate" : "no-write-allocate") << ", "
+             << (inclusive ? "inclusive" : "non-inclusive") << endl;
+        return ERROR;
+    }
+
+    // read everything before touching the cache so a bad file leaves it as it was
+    uint64_t savedAccessCount;
+    std::vector<CacheLine> savedLines(lines.size());
+    std::vector<uint64_t> savedPlruBits(plruBits.size());
+    std::vector<CacheLine> savedVictimLines(victimLines.size());
+    uint64_t generatorSize;
+    bool complete = readValue(in, savedAccessCount) && readLines(in, savedLines);
+    for (uint64_t i = 0; complete && i < savedPlruBits.size(); i++) {
+        complete = readValue(in, savedPlruBits[i]);
+    }
+    complete = complete && readLines(in, savedVictimLines) && readValue(in, generatorSize) &&
+               generatorSize < 0x10000;
+    std::string generatorState(complete ? generatorSize : 0, '\0');
+    complete = complete && in.read(&generatorState[0], generatorSize);
+    if (!complete) {
+        cerr << LOG_ERROR << "Truncated cache state file " << fileName << endl;
+        return ERROR;
+    }
+
+    accessCount = savedAccessCount;
+    lines.swap(savedLines);
+    plruBits.swap(savedPlruBits);
+    victimLines.swap(savedVictimLines);
+    std::istringstream(generatorState) >> generator;
+    for (uint64_t i = 0; i < lines.size(); i++) {
+        tags[i] = lines[i].valid ? lines[i].tag : INVALID_TAG;
+    }
+    return SUCCESS;
+}
+
+uint64_t Cache::getBlockAddress(uint64_t index, uint64_t tag) {
+    return (tag << (numOffsetBits + numIndexBits)) | (index << numOffsetBits);
 }
 
 // getIndex method definition
 uint64_t Cache::getIndex(uint64_t address) {
-    uint64_t index = address >> numOffsetBits;
-    index = index << (64 - numIndexBits - numOffsetBits) >> (64 - numIndexBits - numOffsetBits);
+    // mask with this cache's own set count so the index always lands inside lines
+    uint64_t index = (address >> numOffsetBits) & indexMask;
     return index;
 }
 
@@ -93,6 +815,52 @@ Status Cache::dump(const std::string& base_output_name) {
         cache_out << "Block Size: " << config.blockSize << " bytes" << std::endl;
         cache_out << "Ways: " << (config.ways) << std::endl;
         cache_out << "Miss Latency: " << config.missLatency << " cycles" << std::endl;
+        cache_out << "Replacement Policy: " << getPolicyName(config.policy) << std::endl;
+        cache_out << "Write Policy: " << (config.writeBack ? "write-back" : "write-through") << ", "
+                  << (config.writeAllocate ? "write-allocate" : "no-write-allocate") << std::endl;
+        cache_out << "Store Miss Latency: " << config.storeMissLatency << " cycles" << std::endl;
+        cache_out << "Write Latency: " << config.writeLatency << " cycles" << std::endl;
+        cache_out << "Inclusive: " << (config.inclusive ? "yes" : "no") << std::endl;
+        if (config.victimEntries > 0) {
+            cache_out << "Victim Cache: " << config.victimEntries << " entries, "
+                      << config.victimLatency << " cycles" << std::endl;
+            cache_out << "Victim Hits: " << victimHits << std::endl;
+            cache_out << "Victim Swaps: " << victimSwaps << std::endl;
+        }
+        if (classifier) {
+            cache_out << "Compulsory Misses: " << classifier->getCompulsory() << std::endl;
+            cache_out << "Capacity Misses: " << classifier->getCapacity() << std::endl;
+            cache_out << "Conflict Misses: " << classifier->getConflict() << std::endl;
+        }
+        if (attribution) {
+            // comma separated with a header row so plotting scripts can read them directly
+            cache_out << "---------------------" << endl;
+            cache_out << "Set Heatmap" << endl;
+            cache_out << "set,hits,misses" << endl;
+            for (uint64_t index = 0; index < numSets; index++) {
+                cache_out << index << "," << attribution->setHits[index] << ","
+                          << attribution->setMisses[index] << endl;
+            }
+            std::vector<std::pair<uint64_t, MissAttribution::PcCounts>> pcs(
+                attribution->pcCounts.begin(), attribution->pcCounts.end());
+            uint64_t topN = std::min<uint64_t>(ATTRIBUTION_TOP_PCS, pcs.size());
+            std::partial_sort(pcs.begin(), pcs.begin() + topN, pcs.end(),
+                              [](const std::pair<uint64_t, MissAttribution::PcCounts>& a,
+                                 const std::pair<uint64_t, MissAttribution::PcCounts>& b) {
+                                  if (a.second.misses != b.second.misses) {
+                                      return a.second.misses > b.second.misses;
+                                  }
+                                  return a.first < b.first;
+                              });
+            cache_out << "---------------------" << endl;
+            cache_out << "Top Missing PCs" << endl;
+            cache_out << "pc,accesses,misses" << endl;
+            for (uint64_t i = 0; i < topN && pcs[i].second.misses > 0; i++) {
+                cache_out << "0x" << std::hex << std::setfill('0') << std::setw(8) << pcs[i].first
+                          << std::dec << std::setfill(' ') << "," << pcs[i].second.accesses << ","
+                          << pcs[i].second.misses << endl;
+            }
+        }
         cache_out << "---------------------" << endl;
         cache_out << "End Register Values" << endl;
         cache_out << "---------------------" << endl;
@@ -102,3 +870,269 @@ Status Cache::dump(const std::string& base_output_name) {
         return ERROR;
     }
 }
+
+MissClassifier::MissClassifier(uint64_t numLinesParam) : numLines(numLinesParam) {
+    shadow.reserve(numLines);
+    compulsory = 0;
+    capacity = 0;
+    conflict = 0;
+}
+
+void MissClassifier::access(uint64_t block, bool hit, bool allocated) {
+    // a block the real cache did not allocate was never in it, so the next
+    // access to it is still a compulsory miss
+    bool firstAccess = allocated ? seen.insert(block).second : !seen.count(block);
+
+    auto it = shadow.find(block);
+    bool shadowHit = (it != shadow.end());
+    if (shadowHit) {
+        recency.splice(recency.begin(), recency, it->second);
+    } else if (allocated) {
+        if (shadow.size() == numLines) {
+            shadow.erase(recency.back());
+            recency.pop_back();
+        }
+        recency.push_front(block);
+        shadow[block] = recency.begin();
+    }
+
+    if (hit) {
+        return;
+    }
+    if (firstAccess) {
+        compulsory += 1;
+    } else if (!shadowHit) {
+        capacity += 1;
+    } else {
+        conflict += 1;
+    }
+}
+
+MissRatioCurve::MissRatioCurve(CacheConfig configParam) : config(configParam) {
+    numOffsetBits = log2(config.blockSize);
+    ways = config.ways;
+    for (uint64_t sets = 1; sets * ways * config.blockSize <= MRC_MAX_CACHE_SIZE; sets *= 2) {
+        Level level;
+        level.numSets = sets;
+        level.stacks.assign(sets * ways, 0);
+        level.depths.assign(sets, 0);
+        levels.push_back(level);
+    }
+}
+
+void MissRatioCurve::access(uint64_t address) {
+    uint64_t block = address >> numOffsetBits;
+    for (Level& level : levels) {
+        uint64_t index = block & (level.numSets - 1);
+        uint64_t* stack = &level.stacks[index * ways];
+        uint64_t& depth = level.depths[index];
+
+        // stack distance of the block, depth if it is not in the top ways entries
+        uint64_t distance = 0;
+        while (distance < depth && stack[distance] != block) {
+            distance++;
+        }
+        if (distance < depth) {
+            level.hits += 1;
+        } else {
+            level.misses += 1;
+            if (depth < ways) {
+                depth++;
+            }
+            distance = depth - 1;
+        }
+        // move the block to the top of the stack
+        for (uint64_t i = distance; i > 0; i--) {
+            stack[i] = stack[i - 1];
+        }
+        stack[0] = block;
+    }
+}
+
+void MissRatioCurve::print(const std::string& title, std::ostream& out) {
+    out << title << " (block size " << config.blockSize << ", " << ways << " ways, LRU)" << endl;
+    out << left << setw(14) << "Size (bytes)" << setw(10) << "Sets" << setw(12) << "Hits"
+        << setw(12) << "Misses" << "Miss ratio" << endl;
+    for (Level& level : levels) {
+        uint64_t accesses = level.hits + level.misses;
+        double ratio = accesses ? (double)level.misses / accesses : 0.0;
+        out << left << setw(14) << level.numSets * ways * config.blockSize << setw(10)
+            << level.numSets << setw(12) << level.hits << setw(12) << level.misses
+            << fixed << setprecision(6) << ratio << endl;
+    }
+}
+
+Prefetcher::Prefetcher(Cache* cacheParam) : cache(cacheParam) {
+    issued = 0;
+    late = 0;
+    if (cache->config.prefetcher == PREFETCH_STRIDE) {
+        strideTable.assign(STRIDE_TABLE_SIZE, StrideEntry());
+    }
+}
+
+const char* Prefetcher::getName() {
+    return cache->config.prefetcher == PREFETCH_STRIDE ? "stride" : "next-line";
+}
+
+void Prefetcher::issue(uint64_t address, uint64_t cycle) {
+    uint64_t fillLatency;
+    if (!cache->prefetch(address, fillLatency)) {
+        return;
+    }
+    issued += 1;
+    // forget fills that have long arrived so the table stays small
+    if (inFlight.size() >= 1024) {
+        for (auto it = inFlight.begin(); it != inFlight.end();) {
+            it = (it->second <= cycle) ? inFlight.erase(it) : std::next(it);
+        }
+    }
+    inFlight[address & ~(cache->config.blockSize - 1)] = cycle + fillLatency;
+}
+
+uint64_t Prefetcher::access(uint64_t pc, uint64_t address, uint64_t cycle) {
+    uint64_t blockSize = cache->config.blockSize;
+    uint64_t block = address & ~(blockSize - 1);
+    uint64_t wait = 0;
+
+    if (!inFlight.empty()) {
+        auto it = inFlight.find(block);
+        if (it != inFlight.end()) {
+            if (cache->wasPrefetchHit() && it->second > cycle) {
+                wait = it->second - cycle;
+                late += 1;
+            }
+            inFlight.erase(it);
+        }
+    }
+
+    if (cache->config.prefetcher == PREFETCH_NEXT_LINE) {
+        for (uint64_t i = 1; i <= cache->config.prefetchDegree; i++) {
+            issue(block + i * blockSize, cycle);
+        }
+    } else if (cache->config.prefetcher == PREFETCH_STRIDE) {
+        StrideEntry& entry = strideTable[(pc >> 2) % STRIDE_TABLE_SIZE];
+        if (!entry.valid || entry.pc != pc) {
+            entry = StrideEntry();
+            entry.valid = true;
+            entry.pc = pc;
+        } else {
+            int64_t stride = address - entry.lastAddress;
+            if (stride == entry.stride && stride != 0) {
+                entry.confidence = std::min(entry.confidence + 1, 3);
+            } else if (entry.confidence > 0) {
+                entry.confidence -= 1;
+            } else {
+                entry.stride = stride;
+            }
+            if (entry.confidence >= 2) {
+                for (uint64_t i = 1; i <= cache->config.prefetchDegree; i++) {
+                    issue(address + i * entry.stride, cycle);
+                }
+            }
+        }
+        entry.lastAddress = address;
+    }
+    return wait;
+}
+
+MshrFile::MshrFile(uint64_t numEntriesParam, uint64_t blockSizeParam)
+    : numEntries(numEntriesParam), blockSize(blockSizeParam) {
+    entries.reserve(numEntries);
+    merges = 0;
+    fullStallCycles = 0;
+    occupancyCycles = 0;
+    maxOccupancy = 0;
+}
+
+void MshrFile::tick(uint64_t cycle) {
+    for (uint64_t i = 0; i < entries.size();) {
+        if (entries[i].readyCycle <= cycle) {
+            entries[i] = entries.back();
+            entries.pop_back();
+        } else {
+            i++;
+        }
+    }
+    occupancyCycles += entries.size();
+    maxOccupancy = std::max<uint64_t>(maxOccupancy, entries.size());
+}
+
+bool MshrFile::merge(uint64_t address, uint64_t& readyCycle) {
+    uint64_t block = address & ~(blockSize - 1);
+    for (Entry& entry : entries) {
+        if (entry.blockAddress == block) {
+            readyCycle = entry.readyCycle;
+            merges += 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t MshrFile::allocate(uint64_t address, uint64_t cycle, uint64_t latency, uint64_t& readyCycle) {
+    uint64_t stall = 0;
+    if (entries.size() == numEntries) {
+        // wait for the earliest outstanding fill and take over its entry
+        uint64_t earliest = 0;
+        for (uint64_t i = 1; i < entries.size(); i++) {
+            if (entries[i].readyCycle < entries[earliest].readyCycle) {
+                earliest = i;
+            }
+        }
+        stall = entries[earliest].readyCycle - cycle;
+        fullStallCycles += stall;
+        entries[earliest] = entries.back();
+        entries.pop_back();
+    }
+    readyCycle = cycle + stall + latency;
+    entries.push_back(Entry{address & ~(blockSize - 1), readyCycle});
+    return stall;
+}
+
+Dram::Dram(const DramConfig& configParam)
+    : banks(configParam.channels * configParam.banks),
+      busFreeCycle(configParam.channels, 0),
+      cycle(0),
+      reads(0),
+      writes(0),
+      rowHits(0),
+      bankConflicts(0),
+      bytes(0),
+      config(configParam) {}
+
+uint64_t Dram::access(uint64_t address, bool isWrite, uint64_t size) {
+    uint64_t rowNumber = address / config.rowSize;
+    uint64_t channel = rowNumber % config.channels;
+    rowNumber /= config.channels;
+    Bank& bank = banks[channel * config.banks + rowNumber % config.banks];
+    uint64_t row = rowNumber / config.banks;
+
+    uint64_t start = std::max(cycle, bank.readyCycle);
+    uint64_t latency;
+    if (config.openPage && bank.hasRow && bank.row == row) {
+        rowHits += 1;
+        latency = config.tCAS;
+    } else {
+        latency = config.tRCD + config.tCAS;
+        // an open row has to be closed first, a closed page bank may still be precharging
+        if (bank.hasRow && bank.row != row && (config.openPage || start > cycle)) {
+            bankConflicts += 1;
+        }
+        if (config.openPage && bank.hasRow) {
+            latency += config.tRP;
+        }
+    }
+    uint64_t done = std::max(start + latency, busFreeCycle[channel]) + config.burst;
+    busFreeCycle[channel] = done;
+    bank.hasRow = true;
+    bank.row = row;
+    bank.readyCycle = config.openPage ? done : done + config.tRP;
+
+    if (isWrite) {
+        writes += 1;
+    } else {
+        reads += 1;
+    }
+    bytes += size;
+    return done - cycle;
+}
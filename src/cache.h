@@ -1,10 +1,38 @@
 #pragma once
 #include <inttypes.h>
 #include <iostream>
+#include <list>
+#include <memory>
 #include <vector>
 #include <cmath>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
 #include "Utilities.h"
-#include <list>
+
+// Replacement policies a Cache can be built with. Each one gets its own
+// specialized access loop, see Cache::accessWith.
+enum ReplacementPolicy {
+    REPL_LRU = 0,   // true least recently used
+    REPL_PLRU,      // tree pseudo-LRU, needs a power-of-two number of ways <= 64
+    REPL_FIFO,      // evict the oldest fill, hits do not update state
+    REPL_RANDOM,    // evict a random way
+    REPL_SRRIP,     // static re-reference interval prediction, 2-bit RRPV
+    REPL_BIP,       // bimodal insertion: fill at LRU, occasionally at MRU
+};
+
+// Hardware prefetcher attached to a cache, see Prefetcher.
+enum PrefetcherType {
+    PREFETCH_NONE = 0,
+    PREFETCH_NEXT_LINE,  // prefetch the next N blocks after every access
+    PREFETCH_STRIDE,     // PC-indexed stride detection, prefetch N strides ahead
+};
+
+// name of a policy as written in the cache config file, e.g. "PLRU"
+const char* getPolicyName(ReplacementPolicy policy);
+
+// parse a (case-insensitive) policy name, return false if it is unknown
+bool parsePolicyName(const std::string& name, ReplacementPolicy& policy);
 
 struct CacheConfig {
     // Cache size in bytes.
@@ -15,23 +43,221 @@ struct CacheConfig {
     uint64_t ways;
     // Additional miss latency in cycles.
     uint64_t missLatency;
+    // Replacement policy, LRU unless the config file says otherwise.
+    ReplacementPolicy policy = REPL_LRU;
+    // Write-back keeps stores in the cache and writes dirty lines out on
+    // eviction, write-through sends every store to the next level.
+    bool writeBack = true;
+    // Whether a store miss fills the line (write-allocate) or only writes
+    // the next level (no-write-allocate).
+    bool writeAllocate = true;
+    // Additional latency of a store miss in cycles, same as a load miss by default.
+    uint64_t storeMissLatency = missLatency;
+    // Additional cycles for each write sent to the next level: a dirty
+    // eviction under write-back, every store under write-through.
+    uint64_t writeLatency = 0;
+    // Only for caches with levels above them (L2, L3): keep every block held
+    // above also present here, back-invalidating upper levels on eviction.
+    bool inclusive = false;
+    // Prefetcher and how many blocks (or strides) ahead it prefetches.
+    PrefetcherType prefetcher = PREFETCH_NONE;
+    uint64_t prefetchDegree = 1;
+    // D-cache only: number of MSHRs of a lockup-free cache, 0 for a blocking cache.
+    uint64_t mshrs = 0;
+    // fully associative victim cache of victimEntries lines, a hit in it costs victimLatency
+    uint64_t victimEntries = 0;
+    uint64_t victimLatency = 1;
     // debug: Overload << operator to allow easy printing of CacheConfig
     friend std::ostream& operator<<(std::ostream& os, const CacheConfig& config) {
         os << "CacheConfig { " << config.cacheSize << ", " << config.blockSize << ", "
-           << config.ways << ", " << config.missLatency << " }";
+           << config.ways << ", " << config.missLatency << ", " << getPolicyName(config.policy)
+           << ", " << (config.writeBack ? "write-back" : "write-through") << ", "
+           << (config.writeAllocate ? "write-allocate" : "no-write-allocate") << ", "
+           << config.storeMissLatency << ", " << config.writeLatency
+           << (config.inclusive ? ", inclusive" : "");
+        if (config.prefetcher != PREFETCH_NONE) {
+            os << (config.prefetcher == PREFETCH_STRIDE ? ", stride" : ", next-line")
+               << " prefetch " << config.prefetchDegree;
+        }
+        if (config.mshrs > 0) {
+            os << ", " << config.mshrs << " MSHRs";
+        }
+        if (config.victimEntries > 0) {
+            os << ", " << config.victimEntries << "-entry victim cache";
+        }
+        os << " }";
         return os;
     }
 };
 
-enum CacheDataType { I_CACHE = false, D_CACHE = true };
+// DRAM behind the last-level cache, see Dram. Timings are in cycles.
+struct DramConfig {
+    // 0 channels: no DRAM model, misses of the last level cost its miss latency only
+    uint64_t channels = 0;
+    // banks per channel, each with one row buffer
+    uint64_t banks = 8;
+    // bytes per row
+    uint64_t rowSize = 2048;
+    // activate to read (tRCD), read to data (tCAS) and precharge (tRP)
+    uint64_t tRCD = 14;
+    uint64_t tCAS = 14;
+    uint64_t tRP = 14;
+    // open page keeps a row open after an access, closed page precharges right away
+    bool openPage = true;
+    // cycles the data of one access occupies its channel
+    uint64_t burst = 4;
+    friend std::ostream& operator<<(std::ostream& os, const DramConfig& config) {
+        return os << "DramConfig { " << config.channels << ", " << config.banks << ", "
+                  << config.rowSize << ", " << config.tRCD << ", " << config.tCAS << ", "
+                  << config.tRP << ", " << (config.openPage ? "open-page" : "closed-page")
+                  << ", burst " << config.burst << " }";
+    }
+};
+
+enum CacheDataType { I_CACHE = false, D_CACHE = true, UNIFIED_CACHE = 2 };
 enum CacheOperation { CACHE_READ = false, CACHE_WRITE = true };
 
+// One way of a set. lastUsed is the access count of the most recent touch
+// (of the fill for FIFO), so the LRU way of a set is the valid way with the
+// smallest lastUsed. rrpv is the re-reference prediction value used by SRRIP.
+// dirty marks lines written under write-back that must be written out on eviction.
+struct CacheLine {
+    uint64_t tag = 0;
+    uint64_t lastUsed = 0;
+    bool valid = false;
+    bool dirty = false;
+    // filled by a prefetch and not yet touched by a demand access
+    bool prefetched = false;
+    uint8_t rrpv = 0;
+};
+
+// view of one set handed to the replacement policies, see cache.cpp
+struct CacheSet;
+class Dram;
+
+// Kernels for the per-set tag compare, the best supported one is picked at runtime.
+// Sets of up to INLINE_TAG_MATCH_WAYS ways with 16, 32 or 64 byte blocks compare
+// inline instead, a SIMD kernel only pays off for wider sets.
+#define INLINE_TAG_MATCH_WAYS 4
+enum TagMatchKernel {TAG_MATCH_SCALAR, TAG_MATCH_SSE2, TAG_MATCH_AVX2};
+// packed tag of an invalid way, no address below 2^64 - 1 has this tag
+#define INVALID_TAG (~0ULL)
+
+const char* getTagMatchName(TagMatchKernel kernel);
+bool isTagMatchSupported(TagMatchKernel kernel);
+TagMatchKernel getBestTagMatch();
+
+/** Splits the misses of a cache into the 3Cs. A miss is compulsory if the
+ * block was never accessed before, capacity if a fully associative LRU cache
+ * of the same number of lines would also miss, and conflict otherwise. The
+ * shadow cache is a recency list plus a hash map into it, so every access is
+ * O(1) however many blocks the program touches.
+ */
+class MissClassifier {
+private:
+    uint64_t numLines;
+    std::unordered_set<uint64_t> seen;
+    // shadow fully associative LRU cache, most recent block first
+    std::list<uint64_t> recency;
+    std::unordered_map<uint64_t, std::list<uint64_t>::iterator> shadow;
+    uint64_t compulsory, capacity, conflict;
+
+public:
+    explicit MissClassifier(uint64_t numLinesParam);
+
+    // record an access to block (address >> offset bits) that hit or missed in the
+    // real cache; a block the real cache did not allocate stays out of the shadow too
+    void access(uint64_t block, bool hit, bool allocated);
+
+    uint64_t getCompulsory() { return compulsory; }
+    uint64_t getCapacity() { return capacity; }
+    uint64_t getConflict() { return conflict; }
+};
+
+// Magic and version at the start of a Cache::saveState file.
+#define CACHE_STATE_MAGIC 0x53435652  // "RVCS"
+#define CACHE_STATE_VERSION 2
+
+// Number of PCs listed in the top missing PC table of Cache::dump.
+#define ATTRIBUTION_TOP_PCS 10
+
+// Hits and misses per set and per issuing PC, see Cache::enableMissAttribution.
+struct MissAttribution {
+    struct PcCounts {
+        uint32_t accesses = 0;
+        uint32_t misses = 0;
+    };
+    std::vector<uint32_t> setHits;
+    std::vector<uint32_t> setMisses;
+    std::unordered_map<uint64_t, PcCounts> pcCounts;
+};
+
 class Cache {
 private:
     uint64_t hits, misses;    
+    uint64_t readHits, readMisses, writeHits, writeMisses;
+    // dirty lines written out on eviction, stores sent on to the next level
+    uint64_t writebacks, writeThroughs;
+    // lines dropped because an inclusive level below evicted them
+    uint64_t invalidations;
+    // demand hits on prefetched lines, demand misses on blocks a prefetch evicted
+    uint64_t usefulPrefetches, pollutingPrefetches;
+    // misses served by the victim cache, and those that moved the evicted line into it
+    uint64_t victimHits, victimSwaps;
+    bool lastHitPrefetched;
+    // whether the most recent access left its block in the cache, false for a
+    // store miss under no-write-allocate
+    bool lastAllocated;
+    // blocks evicted by prefetch fills and not referenced since
+    std::unordered_set<uint64_t> prefetchVictims;
+    // additional cycles charged for the most recent access
+    uint64_t lastLatency;
     CacheDataType type;
-    // can also use vector
-    std::unordered_map<int, std::list<uint64_t>> cacheTable;
+    uint64_t numSets;
+    // geometry of this instance: address >> numOffsetBits is the block number,
+    // its low numIndexBits bits (indexMask) the set and the rest the tag
+    int numOffsetBits;
+    int numIndexBits;
+    uint64_t indexMask;
+    // level misses are fetched from (nullptr: memory) and levels it serves
+    Cache* nextLevel;
+    // DRAM timing model misses of the last level are fetched from, if any
+    Dram* memory;
+    std::vector<Cache*> upperLevels;
+    // logical clock used to age lines for LRU
+    uint64_t accessCount;
+    // flat tag array of numSets * ways lines, set i owns lines [i * ways, (i + 1) * ways)
+    std::vector<CacheLine> lines;
+    // tags of lines packed in the same order for the SIMD compare, INVALID_TAG for invalid lines
+    std::vector<uint64_t> tags;
+    TagMatchKernel tagMatchKernel;
+    uint64_t (*matchTag)(const uint64_t* tags, uint64_t ways, uint64_t tag);
+    // tree-PLRU state, one bit per internal node of each set's tree
+    std::vector<uint64_t> plruBits;
+    // victim cache lines, tag holds the full block address
+    std::vector<CacheLine> victimLines;
+    // per-cache generator so RANDOM and BIP runs are reproducible
+    std::mt19937 generator;
+    // 3C classification of the misses, nullptr unless enabled
+    std::unique_ptr<MissClassifier> classifier;
+    // per-set and per-PC counters, nullptr unless enabled
+    std::unique_ptr<MissAttribution> attribution;
+
+    // access loop specialized for one replacement policy and geometry
+    template <class Policy, class Geometry>
+    bool accessWith(uint64_t address, CacheOperation readWrite);
+    // accessWith instance for this cache's policy and geometry, set by selectAccessLoop
+    bool (Cache::*accessFn)(uint64_t address, CacheOperation readWrite);
+    void selectAccessLoop();
+    template <class Policy>
+    bool prefetchWith(uint64_t address, uint64_t& fillLatency);
+    template <class Policy>
+    void fill(CacheSet& set, uint64_t index, uint64_t tag, bool dirty, bool isPrefetch);
+    template <class Policy>
+    bool swapVictim(CacheSet& set, uint64_t index, uint64_t tag, bool isWrite);
+    bool insertVictim(uint64_t& blockAddress, bool& dirty);
+    void writeNextLevel(uint64_t address);
+    uint64_t getBlockAddress(uint64_t index, uint64_t tag);
 
 public:
     CacheConfig config;
@@ -43,17 +269,257 @@ public:
      * @param
      *      address: memory address
      *      readWrite: true for read operation and false for write operation
+     *      pc: address of the instruction issuing the access, for miss attribution
      */
-    bool access(uint64_t address, CacheOperation readWrite);
+    bool access(uint64_t address, CacheOperation readWrite, uint64_t pc = 0);
 
     // debug: dump information as you needed
     Status dump(const std::string& base_output_name);
 
+    /** Bring the block holding address into the cache without counting a hit
+     * or miss and without changing getLastLatency().
+     * @return false if the block was already present (nothing issued)
+     * @param fillLatency: set to the cycles the fill takes to arrive
+     */
+    bool prefetch(uint64_t address, uint64_t& fillLatency);
+
+    // back this cache by next: misses are fetched from it and add its latency
+    void setNextLevel(Cache* next);
+
+    // back this (last-level) cache by a DRAM model: misses add the latency it computes
+    // for them and writes to memory occupy its banks and channels
+    void setMemory(Dram* dram) { memory = dram; }
+
+    /** Drop every line overlapping [address, address + size), here and in the levels above.
+     * @return true if any dropped line was dirty
+     */
+    bool invalidate(uint64_t address, uint64_t size);
+
     // TODO: You may add more methods and fields as needed
 
+    /** Write the tag, valid, dirty and replacement state (no statistics) to a
+     * binary file, tagged with the geometry and policy of this cache.
+     */
+    Status saveState(const std::string& fileName);
+
+    /** Load state written by saveState. Fails, leaving the cache unchanged, if
+     * the file is unreadable, of another version, or from a cache with a
+     * different size, block size, ways, victim cache, replacement policy, write
+     * policy or inclusion.
+     */
+    Status loadState(const std::string& fileName);
+
+    // use kernel for tag compares, false (and no change) if this CPU lacks it
+    bool setTagMatch(TagMatchKernel kernel);
+    // whether accesses to a cache with config compare tags with the kernel of
+    // setTagMatch, rather than inline in a loop specialized for its geometry
+    static bool usesTagMatch(const CacheConfig& config);
+    TagMatchKernel getTagMatch() { return tagMatchKernel; }
+
+    // classify every later miss as compulsory, capacity or conflict
+    void enableMissClassification();
+    bool classifiesMisses() { return classifier != nullptr; }
+
+    // count hits and misses per set and per PC, written out by dump()
+    void enableMissAttribution();
+    uint64_t getCompulsoryMisses() { return classifier ? classifier->getCompulsory() : 0; }
+    uint64_t getCapacityMisses() { return classifier ? classifier->getCapacity() : 0; }
+    uint64_t getConflictMisses() { return classifier ? classifier->getConflict() : 0; }
+
     uint64_t getHits() { return hits; }
     uint64_t getMisses() { return misses; }
+    uint64_t getReadHits() { return readHits; }
+    uint64_t getReadMisses() { return readMisses; }
+    uint64_t getWriteHits() { return writeHits; }
+    uint64_t getWriteMisses() { return writeMisses; }
+    uint64_t getWritebacks() { return writebacks; }
+    uint64_t getWriteThroughs() { return writeThroughs; }
+    uint64_t getInvalidations() { return invalidations; }
+    uint64_t getUsefulPrefetches() { return usefulPrefetches; }
+    uint64_t getPollutingPrefetches() { return pollutingPrefetches; }
+    uint64_t getVictimHits() { return victimHits; }
+    uint64_t getVictimSwaps() { return victimSwaps; }
+    // whether the last access was the first demand hit on a prefetched line
+    bool wasPrefetchHit() { return lastHitPrefetched; }
+
+    // additional cycles the most recent access costs: the load or store miss
+    // latency plus writeLatency for any write sent to the next level, plus the
+    // latency of the next level on a miss, 0 for a clean hit
+    uint64_t getLastLatency() { return lastLatency; }
 
     uint64_t getIndex(uint64_t address);
     uint64_t getTag(uint64_t address);
 };
+
+// Largest cache size swept by MissRatioCurve.
+#define MRC_MAX_CACHE_SIZE 0x100000
+
+/** Single-pass miss ratio curve for LRU caches (Mattson's stack algorithm).
+ * Keeps one per-set LRU stack for every power-of-two number of sets, from a
+ * single set up to MRC_MAX_CACHE_SIZE bytes, all at the block size and
+ * associativity of the given config. An access hits a given cache size iff
+ * its stack distance within its set is below the associativity, so stacks
+ * are only kept ways deep and one pass yields hits/misses for every size.
+ */
+class MissRatioCurve {
+private:
+    struct Level {
+        uint64_t numSets;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        // numSets stacks of ways block addresses each, most recent first
+        std::vector<uint64_t> stacks;
+        // number of valid entries in each stack
+        std::vector<uint64_t> depths;
+    };
+
+    int numOffsetBits;
+    uint64_t ways;
+    std::vector<Level> levels;
+
+public:
+    CacheConfig config;
+    MissRatioCurve(CacheConfig configParam);
+
+    // feed one access of the stream the curve is built from
+    void access(uint64_t address);
+
+    // print one row per cache size: size, sets, hits, misses and miss ratio
+    void print(const std::string& title, std::ostream& out);
+};
+
+// Number of entries in the PC-indexed table of a stride prefetcher.
+#define STRIDE_TABLE_SIZE 64
+
+/** Hardware prefetcher for one cache, configured by its CacheConfig.
+ * next-line prefetches the prefetchDegree blocks after every accessed block;
+ * stride keeps a PC-indexed table of the last address and stride of each load
+ * or store and, once a stride repeats, prefetches prefetchDegree strides ahead.
+ * Prefetch fills never stall the pipeline; a demand access that finds its block
+ * still in flight waits only for the rest of the fill and is counted as late.
+ */
+class Prefetcher {
+private:
+    struct StrideEntry {
+        bool valid = false;
+        uint64_t pc = 0;
+        uint64_t lastAddress = 0;
+        int64_t stride = 0;
+        // 2-bit saturating counter, prefetch once it reaches 2
+        uint8_t confidence = 0;
+    };
+
+    Cache* cache;
+    std::vector<StrideEntry> strideTable;
+    // prefetched blocks still in flight: block address -> cycle the fill arrives
+    std::unordered_map<uint64_t, uint64_t> inFlight;
+    uint64_t issued, late;
+
+    void issue(uint64_t address, uint64_t cycle);
+
+public:
+    Prefetcher(Cache* cacheParam);
+
+    /** Observe a demand access just made to the cache and issue prefetches.
+     * @return extra cycles the access has to wait for a late prefetch
+     * @param
+     *      pc: address of the instruction making the access
+     *      address: memory address accessed
+     *      cycle: current cycle
+     */
+    uint64_t access(uint64_t pc, uint64_t address, uint64_t cycle);
+
+    // name as written in the cache config file
+    const char* getName();
+
+    uint64_t getIssued() { return issued; }
+    uint64_t getLate() { return late; }
+};
+
+/** Miss status holding registers of a lockup-free cache. Each entry tracks one
+ * block with an outstanding fill and the cycle the fill completes; later misses
+ * to the same block merge into it instead of taking a new entry.
+ */
+class MshrFile {
+private:
+    struct Entry {
+        uint64_t blockAddress;
+        uint64_t readyCycle;
+    };
+
+    uint64_t numEntries;
+    uint64_t blockSize;
+    // active entries, capacity reserved up front
+    std::vector<Entry> entries;
+    uint64_t merges, fullStallCycles, occupancyCycles, maxOccupancy;
+
+public:
+    MshrFile(uint64_t numEntriesParam, uint64_t blockSizeParam);
+
+    // free the entries whose fill completed by cycle and account the occupancy of this cycle
+    void tick(uint64_t cycle);
+
+    /** Merge an access into an outstanding fill of its block, if any.
+     * @return true if merged, readyCycle then holds the cycle the fill completes
+     */
+    bool merge(uint64_t address, uint64_t& readyCycle);
+
+    /** Track a new miss taking latency cycles from cycle on.
+     * @return cycles the pipeline has to stall because every entry is busy
+     * @param readyCycle: set to the cycle the fill completes
+     */
+    uint64_t allocate(uint64_t address, uint64_t cycle, uint64_t latency, uint64_t& readyCycle);
+
+    uint64_t getNumEntries() { return numEntries; }
+    uint64_t getMerges() { return merges; }
+    uint64_t getFullStallCycles() { return fullStallCycles; }
+    // sum over cycles of the number of busy entries
+    uint64_t getOccupancyCycles() { return occupancyCycles; }
+    uint64_t getMaxOccupancy() { return maxOccupancy; }
+};
+
+/** Timing model of the DRAM behind the last-level cache. Addresses map to a
+ * column within a row, then a channel, a bank and a row, so consecutive rows
+ * are spread over the channels first. Each bank keeps the row it last opened:
+ * under the open-page policy an access to that row only costs tCAS, another row
+ * costs tRP + tRCD + tCAS; under the closed-page policy every access costs
+ * tRCD + tCAS and the bank precharges (tRP) after it. An access waits for its
+ * bank to be free and its data for the channel, which bounds the bandwidth.
+ */
+class Dram {
+private:
+    struct Bank {
+        bool hasRow = false;
+        uint64_t row = 0;
+        // cycle the bank can start the next access
+        uint64_t readyCycle = 0;
+    };
+
+    // banks of channel c are banks[c * config.banks, (c + 1) * config.banks)
+    std::vector<Bank> banks;
+    // cycle each channel's data bus is free
+    std::vector<uint64_t> busFreeCycle;
+    uint64_t cycle;
+    uint64_t reads, writes, rowHits, bankConflicts, bytes;
+
+public:
+    DramConfig config;
+    Dram(const DramConfig& configParam);
+
+    // current cycle, accesses are issued at it
+    void setCycle(uint64_t cycleParam) { cycle = cycleParam; }
+
+    /** Read or write size bytes at address.
+     * @return cycles until the data has been transferred
+     */
+    uint64_t access(uint64_t address, bool isWrite, uint64_t size);
+
+    uint64_t getReads() { return reads; }
+    uint64_t getWrites() { return writes; }
+    // accesses to the row already open in their bank
+    uint64_t getRowHits() { return rowHits; }
+    // accesses to another row than the one last opened in their bank that had to
+    // precharge it first or wait for it to finish
+    uint64_t getBankConflicts() { return bankConflicts; }
+    uint64_t getBytes() { return bytes; }
+};
@@ -0,0 +1,102 @@
+/** NOTE cache microbenchmark
+ * Drives Cache::access with synthetic address streams and reports how many
+ * accesses per second the cache model sustains, together with the hit/miss
+ * counts so that different cache implementations can be checked against
+ * each other on the same streams. A final sweep runs every associativity
+ * from 1 to 32 ways with each tag match kernel the CPU supports and the
+ * geometry uses.
+ */
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "cache.h"
+#include "Utilities.h"
+
+using namespace std;
+
+static void runPattern(const string& name, const CacheConfig& config,
+                       const vector<uint64_t>& addresses, TagMatchKernel kernel = getBestTagMatch()) {
+    Cache cache(config, D_CACHE);
+    cache.setTagMatch(kernel);
+
+    auto start = chrono::steady_clock::now();
+    for (uint64_t address : addresses) {
+        cache.access(address, CACHE_READ);
+    }
+    auto end = chrono::steady_clock::now();
+
+    double seconds = chrono::duration<double>(end - start).count();
+    cout << left << setw(12) << name << setw(8) << getPolicyName(config.policy)
+         << setw(8) << getTagMatchName(kernel) << " hits: " << setw(10) << cache.getHits()
+         << " misses: " << setw(10) << cache.getMisses()
+         << " accesses/s: " << (uint64_t)(addresses.size() / seconds) << endl;
+}
+
+int main(int argc, char** argv) {
+    // defaults match the D-cache in test/cache_config.txt
+    CacheConfig config{4096, 16, 4, 8};
+    uint64_t numAccesses = 10000000;
+    if (argc == 2 || argc == 3 || argc > 6) {
+        cerr << LOG_ERROR << "Usage: " << argv[0]
+             << " [<cache size> <block size> <ways> [accesses [policy]]]" << endl;
+        return ERROR;
+    }
+    if (argc >= 4) {
+        config.cacheSize = stoull(argv[1]);
+        config.blockSize = stoull(argv[2]);
+        config.ways = stoull(argv[3]);
+    }
+    if (argc >= 5) {
+        numAccesses = stoull(argv[4]);
+    }
+    if (argc == 6 && !parsePolicyName(argv[5], config.policy)) {
+        cerr << LOG_ERROR << "Unknown replacement policy " << argv[5] << endl;
+        return ERROR;
+    }
+    cout << LOG_INFO << LOG_VAR(config) << LOG_VAR(numAccesses) << endl;
+
+    // fixed seed so every run (and every implementation) sees the same streams
+    mt19937_64 generator(42);
+    vector<uint64_t> addresses(numAccesses);
+
+    // word-by-word walk over a buffer 16x the cache size
+    for (uint64_t i = 0; i < numAccesses; i++) {
+        addresses[i] = (i * 4) % (config.cacheSize * 16);
+    }
+    runPattern("stream", config, addresses);
+
+    // loop over a working set that fits in half the cache
+    for (uint64_t i = 0; i < numAccesses; i++) {
+        addresses[i] = (i * 4) % (config.cacheSize / 2);
+    }
+    runPattern("loop", config, addresses);
+
+    // uniform random over a working set twice the cache size
+    uniform_int_distribution<uint64_t> distribution(0, config.cacheSize * 2 - 1);
+    for (uint64_t i = 0; i < numAccesses; i++) {
+        addresses[i] = distribution(generator) & ~3ULL;
+    }
+    runPattern("random", config, addresses);
+
+    // same random stream at every associativity; each kernel must report the same counts
+    // (geometries that compare inline only run, and only list, the scalar compare)
+    for (uint64_t ways = 1; ways <= 32; ways *= 2) {
+        CacheConfig sweepConfig = config;
+        sweepConfig.ways = ways;
+        if (sweepConfig.cacheSize / sweepConfig.blockSize < ways) {
+            break;
+        }
+        int lastKernel = Cache::usesTagMatch(sweepConfig) ? TAG_MATCH_AVX2 : TAG_MATCH_SCALAR;
+        for (int kernel = TAG_MATCH_SCALAR; kernel <= lastKernel; kernel++) {
+            if (isTagMatchSupported(static_cast<TagMatchKernel>(kernel))) {
+                runPattern(to_string(ways) + "-way", sweepConfig, addresses,
+                           static_cast<TagMatchKernel>(kernel));
+            }
+        }
+    }
+
+    return SUCCESS;
+}
@@ -1,5 +1,6 @@
 #include "cycle.h"
 
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -12,6 +13,22 @@
 static Simulator* simulator = nullptr;
 static Cache* iCache = nullptr;
 static Cache* dCache = nullptr;
+static Cache* l2Cache = nullptr;
+static Cache* l3Cache = nullptr;
+static Prefetcher* iPrefetcher = nullptr;
+static Prefetcher* dPrefetcher = nullptr;
+static bool mrcEnabled = false;
+static bool missClassificationEnabled = false;
+static bool missAttributionEnabled = false;
+static std::string cacheLoadPrefix;
+static std::string cacheSavePrefix;
+static MissRatioCurve* iCurve = nullptr;
+static MissRatioCurve* dCurve = nullptr;
+static MshrFile* dMshrs = nullptr;
+static Dram* dram = nullptr;
+// with MSHRs: cycle each register's pending load miss completes, 0 if none
+static uint64_t regReady[32] = {0};
+static uint64_t numMissUseStalls = 0;
 static std::string output;
 static uint64_t cycleCount = 0;
 
@@ -47,17 +64,99 @@ static struct PipelineInfo {
 } pipelineInfo;
 
 
+// caches that exist with the names their checkpoint files use
+static std::vector<std::pair<std::string, Cache*>> getCacheLevels() {
+    std::vector<std::pair<std::string, Cache*>> levels = {{"icache", iCache}, {"dcache", dCache}};
+    if (l2Cache) {
+        levels.push_back({"l2", l2Cache});
+    }
+    if (l3Cache) {
+        levels.push_back({"l3", l3Cache});
+    }
+    return levels;
+}
+
 // initialize the simulator
 Status initSimulator(CacheConfig& iCacheConfig, CacheConfig& dCacheConfig, MemoryStore* mem,
-                     const std::string& output_name) {
+                     const std::string& output_name, const std::vector<CacheConfig>& lowerLevels,
+                     const DramConfig& dramConfig) {
     output = output_name;
     simulator = new Simulator();
     simulator->setMemory(mem);
     iCache = new Cache(iCacheConfig, I_CACHE);
     dCache = new Cache(dCacheConfig, D_CACHE);
+    if (lowerLevels.size() > 0) {
+        l2Cache = new Cache(lowerLevels[0], UNIFIED_CACHE);
+        iCache->setNextLevel(l2Cache);
+        dCache->setNextLevel(l2Cache);
+    }
+    if (lowerLevels.size() > 1) {
+        l3Cache = new Cache(lowerLevels[1], UNIFIED_CACHE);
+        l2Cache->setNextLevel(l3Cache);
+    }
+    if (dramConfig.channels > 0) {
+        dram = new Dram(dramConfig);
+        // the last level: L3, L2, or both L1 caches
+        if (l3Cache || l2Cache) {
+            (l3Cache ? l3Cache : l2Cache)->setMemory(dram);
+        } else {
+            iCache->setMemory(dram);
+            dCache->setMemory(dram);
+        }
+    }
+    if (iCacheConfig.prefetcher != PREFETCH_NONE) {
+        iPrefetcher = new Prefetcher(iCache);
+    }
+    if (dCacheConfig.prefetcher != PREFETCH_NONE) {
+        dPrefetcher = new Prefetcher(dCache);
+    }
+    if (!cacheLoadPrefix.empty()) {
+        for (auto& level : getCacheLevels()) {
+            if (level.second->loadState(cacheLoadPrefix + "_" + level.first + ".ckpt") != SUCCESS) {
+                return ERROR;
+            }
+        }
+    }
+    if (missClassificationEnabled) {
+        for (Cache* cache : {iCache, dCache, l2Cache, l3Cache}) {
+            if (cache) {
+                cache->enableMissClassification();
+            }
+        }
+    }
+    if (missAttributionEnabled) {
+        iCache->enableMissAttribution();
+        dCache->enableMissAttribution();
+    }
+    if (mrcEnabled) {
+        iCurve = new MissRatioCurve(iCacheConfig);
+        dCurve = new MissRatioCurve(dCacheConfig);
+    }
+    if (dCacheConfig.mshrs > 0) {
+        dMshrs = new MshrFile(dCacheConfig.mshrs, dCacheConfig.blockSize);
+    }
     return SUCCESS;
 }
 
+void enableMissRatioCurves() {
+    mrcEnabled = true;
+}
+
+void enableMissClassification() {
+    missClassificationEnabled = true;
+}
+
+void enableMissAttribution() {
+    missAttributionEnabled = true;
+}
+
+void setCacheCheckpoints(const std::string& loadPrefix, const std::string& savePrefix) {
+    cacheLoadPrefix = loadPrefix;
+    cacheSavePrefix = savePrefix;
+}
+
+void setEntryPoint(uint64_t pc) { PC = pc; }
+
 // run the simulator for a certain number of cycles
 // return SUCCESS if reaching desired cycles.
 // return HALT if the simulator halts on 0xfeedfeed
@@ -78,6 +177,13 @@ Status runCycles(uint64_t cycles) {
  
         pipelineInfo.wbInst = nop(BUBBLE);
 
+        if (dMshrs) {
+            dMshrs->tick(cycleCount);
+        }
+        if (dram) {
+            dram->setCycle(cycleCount);
+        }
+
         // simulate D-cache stalls
         if (numDCacheStalls > 0) {
             numDCacheStalls -= 1;
@@ -100,12 +206,14 @@ Status runCycles(uint64_t cycles) {
             PC = 0x8000;
         }
 
-        pipelineInfo.wbInst = simulator->simWB(pipelineInfo.memInst);
+        pipelineInfo.wbInst = pipelineInfo.memInst;
+        simulator->simWB(pipelineInfo.wbInst);
         // forward to rs2 of load if needed: no stall for load-store (WB-> MEM)
         if (pipelineInfo.wbInst.opcode == OP_LOAD && pipelineInfo.exInst.opcode == OP_STORE && pipelineInfo.wbInst.rd == pipelineInfo.exInst.rs2) {
             pipelineInfo.exInst.op2Val = pipelineInfo.wbInst.memResult;
         }
-        pipelineInfo.memInst = simulator->simMEM(pipelineInfo.exInst);
+        pipelineInfo.memInst = pipelineInfo.exInst;
+        simulator->simMEM(pipelineInfo.memInst);
 
         // simulate D-cache
         if (pipelineInfo.memInst.opcode == OP_LOAD || pipelineInfo.memInst.opcode == OP_STORE) {
@@ -113,18 +221,46 @@ Status runCycles(uint64_t cycles) {
             if (pipelineInfo.memInst.opcode == OP_STORE) {
                 op = CACHE_WRITE;
             }
-            bool hit = dCache->access(pipelineInfo.memInst.memAddress, op);
+            bool hit = dCache->access(pipelineInfo.memInst.memAddress, op, pipelineInfo.memInst.PC);
+            if (dCurve) {
+                dCurve->access(pipelineInfo.memInst.memAddress);
+            }
             if (!hit) {
                 std::cout << "d cache miss: "  << PC << std::endl;
-                numDCacheStalls = dCache->config.missLatency;
+            }
+            // load/store miss latency plus any write-through or writeback traffic
+            numDCacheStalls = dCache->getLastLatency();
+            if (dPrefetcher) {
+                // prefetch fills run in the background, only a late prefetch adds stalls
+                uint64_t lateCycles = dPrefetcher->access(pipelineInfo.memInst.PC,
+                                                          pipelineInfo.memInst.memAddress, cycleCount);
+                numDCacheStalls = std::max<uint64_t>(numDCacheStalls, lateCycles);
             }
 
             // handle memory exceptions
             if (pipelineInfo.memInst.memException) {
                 std::cout << "caught mem exception at: "  << PC << std::endl;
                 numDCacheStalls = 0;
+            } else if (dMshrs) {
+                // lockup-free: the miss goes to an MSHR and the pipeline only stalls when
+                // every MSHR is busy; consumers of the loaded register wait in ID instead
+                uint64_t latency = numDCacheStalls;
+                uint64_t readyCycle = 0;
+                numDCacheStalls = 0;
+                if (!dMshrs->merge(pipelineInfo.memInst.memAddress, readyCycle) && latency > 0) {
+                    numDCacheStalls = dMshrs->allocate(pipelineInfo.memInst.memAddress, cycleCount,
+                                                       latency, readyCycle);
+                }
+                if (pipelineInfo.memInst.opcode == OP_LOAD && pipelineInfo.memInst.rd != 0 &&
+                    readyCycle > cycleCount + numDCacheStalls) {
+                    regReady[pipelineInfo.memInst.rd] = readyCycle;
+                }
             }
         }
+        // a younger writer of a register supersedes its pending load
+        if (dMshrs && pipelineInfo.memInst.writesRd && pipelineInfo.memInst.opcode != OP_LOAD) {
+            regReady[pipelineInfo.memInst.rd] = 0;
+        }
         
         // applies to load-use with stalling
         // load-use for R-type (load first, then use as an input register)
@@ -167,9 +303,17 @@ Status runCycles(uint64_t cycles) {
             // update stats
             numLoadStalls += 1;
             std::cout << "another load use stall for load then store: " << pipelineInfo.memInst.PC << std::endl;
+
+        // miss-use: a source register still waits on a load miss held in an MSHR
+        } else if (dMshrs && ((pipelineInfo.idInst.readsRs1 && regReady[pipelineInfo.idInst.rs1] >= cycleCount) ||
+                              (pipelineInfo.idInst.readsRs2 && regReady[pipelineInfo.idInst.rs2] >= cycleCount))) {
+            pipelineInfo.exInst = nop(BUBBLE);
+
+            // update stats
+            numMissUseStalls += 1;
         } else {
             // delete maybe: "refresh" id instruction registers in case of long cache stalls
-            pipelineInfo.idInst = simulator->simID(pipelineInfo.idInst); 
+            simulator->simID(pipelineInfo.idInst);
 
             // NOP in between load and store, 
             if (pipelineInfo.wbInst.opcode == OP_LOAD 
@@ -243,7 +387,7 @@ Status runCycles(uint64_t cycles) {
                     pipelineInfo.idInst.op2Val = pipelineInfo.exInst.arithResult;
                 }
                 pipelineInfo.exInst = nop(BUBBLE);
-                pipelineInfo.idInst = simulator->simNextPCResolution(pipelineInfo.idInst);
+                simulator->simNextPCResolution(pipelineInfo.idInst);
             // two cycle load branch stall
             } else if ((pipelineInfo.idInst.opcode == OP_BRANCH || pipelineInfo.idInst.opcode == OP_JALR) 
                 && (pipelineInfo.exInst.opcode == OP_LOAD)
@@ -256,12 +400,12 @@ Status runCycles(uint64_t cycles) {
                     pipelineInfo.idInst.op2Val = pipelineInfo.exInst.arithResult;
                 }
                 pipelineInfo.exInst = nop(BUBBLE);
-                // pipelineInfo.idInst = simulator->simNextPCResolution(pipelineInfo.idInst);
+                // simulator->simNextPCResolution(pipelineInfo.idInst);
             } else if ((pipelineInfo.idInst.opcode == OP_BRANCH || pipelineInfo.idInst.opcode == OP_JALR) 
                 && (pipelineInfo.wbInst.opcode == OP_LOAD)
                 && (pipelineInfo.idInst.rs1 == pipelineInfo.wbInst.rd || pipelineInfo.idInst.rs2 == pipelineInfo.wbInst.rd)) {
 
-                pipelineInfo.idInst = simulator->simID(pipelineInfo.idInst);
+                simulator->simID(pipelineInfo.idInst);
                 // should we call operand collection here again so that we have the most up to date input register
                 if (pipelineInfo.idInst.rs1 == pipelineInfo.wbInst.rd) {
                     pipelineInfo.idInst.op1Val = pipelineInfo.wbInst.memResult;
@@ -271,7 +415,7 @@ Status runCycles(uint64_t cycles) {
                 }
                 pipelineInfo.exInst = nop(BUBBLE);
                 // "refresh" the branch's next PC
-                pipelineInfo.idInst = simulator->simNextPCResolution(pipelineInfo.idInst);
+                simulator->simNextPCResolution(pipelineInfo.idInst);
 
                 // update stats
                 numLoadStalls += 1;
@@ -282,7 +426,8 @@ Status runCycles(uint64_t cycles) {
                     pipelineInfo.idInst = nop(SQUASHED);
                 }
 
-                pipelineInfo.exInst = simulator->simEX(pipelineInfo.idInst);
+                pipelineInfo.exInst = pipelineInfo.idInst;
+                simulator->simEX(pipelineInfo.exInst);
 
                 if (numICacheStalls > 0) {
                     pipelineInfo.idInst = nop(BUBBLE);
@@ -290,7 +435,6 @@ Status runCycles(uint64_t cycles) {
                 }
 
                 if (inBranch) {
-                    simulator->simNextPCResolution(pipelineInfo.idInst);
                     correctBranchPC = pipelineInfo.idInst.nextPC;
                 }
                 
@@ -304,14 +448,16 @@ Status runCycles(uint64_t cycles) {
                         pipelineInfo.ifInst.status = NORMAL;
                     }
 
-                    pipelineInfo.idInst = simulator->simID(pipelineInfo.ifInst);
+                    pipelineInfo.idInst = pipelineInfo.ifInst;
+                    simulator->simID(pipelineInfo.idInst);
                     // after raising an illegal instruction exception, squash future instructions
                     if (reachedIllegal && !pipelineInfo.idInst.isHalt && !pipelineInfo.idInst.isNop) {
                         pipelineInfo.idInst = nop(SQUASHED);
                     }
                 // mem exception
                 } else {
-                    pipelineInfo.idInst = simulator->simID(pipelineInfo.ifInst);
+                    pipelineInfo.idInst = pipelineInfo.ifInst;
+                    simulator->simID(pipelineInfo.idInst);
                     // after raising an illegal instruction exception, squash future instructions
                     // if (!pipelineInfo.idInst.isHalt && !pipelineInfo.idInst.isNop) {
                     //     pipelineInfo.idInst = nop(SQUASHED);
@@ -328,10 +474,20 @@ Status runCycles(uint64_t cycles) {
                 // simulate ICache
         
                 std::cout << "i cache search " << pipelineInfo.ifInst.PC << std::endl;
-                bool iHit = iCache->access(pipelineInfo.ifInst.PC, CACHE_READ);
+                bool iHit = iCache->access(pipelineInfo.ifInst.PC, CACHE_READ, pipelineInfo.ifInst.PC);
+                if (iCurve) {
+                    iCurve->access(pipelineInfo.ifInst.PC);
+                }
                 // std::cout << "line263 "  << std::endl;
                 if (!iHit) {
-                    numICacheStalls = iCache->config.missLatency + 1;
+                    numICacheStalls = iCache->getLastLatency() + 1;
+                }
+                if (iPrefetcher) {
+                    uint64_t lateCycles = iPrefetcher->access(pipelineInfo.ifInst.PC,
+                                                              pipelineInfo.ifInst.PC, cycleCount);
+                    if (lateCycles > 0) {
+                        numICacheStalls = lateCycles + 1;
+                    }
                 }
                 PC = PC + 4;
                 // exception handling: jump to address 0x8000 after reaching first illegal instruction
@@ -394,6 +550,103 @@ Status runTillHalt() {
 Status finalizeSimulator() {
     simulator->dumpRegMem(output);
     SimulationStats stats{simulator->getDin(),  cycleCount, iCache->getHits(), iCache->getMisses(), dCache->getHits(), dCache->getMisses(), numLoadStalls};  // TODO incomplete implementation
+    if (iCache->config.policy != REPL_LRU || dCache->config.policy != REPL_LRU) {
+        stats.icPolicy = getPolicyName(iCache->config.policy);
+        stats.dcPolicy = getPolicyName(dCache->config.policy);
+    }
+    stats.dcWriteDetails = !dCache->config.writeBack || !dCache->config.writeAllocate;
+    stats.dcReadHits = dCache->getReadHits();
+    stats.dcReadMisses = dCache->getReadMisses();
+    stats.dcWriteHits = dCache->getWriteHits();
+    stats.dcWriteMisses = dCache->getWriteMisses();
+    stats.dcWritebacks = dCache->getWritebacks();
+    stats.dcWriteThroughs = dCache->getWriteThroughs();
+    if (iPrefetcher) {
+        stats.icPrefetcher = iPrefetcher->getName();
+        stats.icPrefetchIssued = iPrefetcher->getIssued();
+        stats.icPrefetchUseful = iCache->getUsefulPrefetches();
+        stats.icPrefetchLate = iPrefetcher->getLate();
+        stats.icPrefetchPolluting = iCache->getPollutingPrefetches();
+    }
+    if (dPrefetcher) {
+        stats.dcPrefetcher = dPrefetcher->getName();
+        stats.dcPrefetchIssued = dPrefetcher->getIssued();
+        stats.dcPrefetchUseful = dCache->getUsefulPrefetches();
+        stats.dcPrefetchLate = dPrefetcher->getLate();
+        stats.dcPrefetchPolluting = dCache->getPollutingPrefetches();
+    }
+    if (l2Cache) {
+        stats.l2Policy = getPolicyName(l2Cache->config.policy);
+        stats.l2Hits = l2Cache->getHits();
+        stats.l2Misses = l2Cache->getMisses();
+        stats.l2Writebacks = l2Cache->getWritebacks();
+    }
+    if (l3Cache) {
+        stats.l3Policy = getPolicyName(l3Cache->config.policy);
+        stats.l3Hits = l3Cache->getHits();
+        stats.l3Misses = l3Cache->getMisses();
+        stats.l3Writebacks = l3Cache->getWritebacks();
+    }
+    if (dMshrs) {
+        stats.dcMshrs = dMshrs->getNumEntries();
+        stats.dcMshrMerges = dMshrs->getMerges();
+        stats.dcMshrFullStalls = dMshrs->getFullStallCycles();
+        stats.dcMshrAvgOccupancy = cycleCount ? (double)dMshrs->getOccupancyCycles() / cycleCount : 0;
+        stats.dcMshrMaxOccupancy = dMshrs->getMaxOccupancy();
+        stats.missUseStalls = numMissUseStalls;
+    }
+    stats.icVictimEntries = iCache->config.victimEntries;
+    stats.icVictimHits = iCache->getVictimHits();
+    stats.icVictimSwaps = iCache->getVictimSwaps();
+    stats.dcVictimEntries = dCache->config.victimEntries;
+    stats.dcVictimHits = dCache->getVictimHits();
+    stats.dcVictimSwaps = dCache->getVictimSwaps();
+    if (dram) {
+        stats.dramReads = dram->getReads();
+        stats.dramWrites = dram->getWrites();
+        stats.dramRowHits = dram->getRowHits();
+        stats.dramBankConflicts = dram->getBankConflicts();
+        stats.dramBandwidth = cycleCount ? (double)dram->getBytes() / cycleCount : 0;
+    }
+    if (missClassificationEnabled) {
+        stats.missClassification = true;
+        stats.icMissClasses = {iCache->getCompulsoryMisses(), iCache->getCapacityMisses(),
+                               iCache->getConflictMisses()};
+        stats.dcMissClasses = {dCache->getCompulsoryMisses(), dCache->getCapacityMisses(),
+                               dCache->getConflictMisses()};
+        if (l2Cache) {
+            stats.l2MissClasses = {l2Cache->getCompulsoryMisses(), l2Cache->getCapacityMisses(),
+                                   l2Cache->getConflictMisses()};
+        }
+        if (l3Cache) {
+            stats.l3MissClasses = {l3Cache->getCompulsoryMisses(), l3Cache->getCapacityMisses(),
+                                   l3Cache->getConflictMisses()};
+        }
+    }
     dumpSimStats(stats, output);
+    if (iCurve && dCurve) {
+        std::ofstream mrc_out(output + "_mrc.out");
+        if (!mrc_out) {
+            std::cerr << LOG_ERROR << "Could not open miss ratio curve file!" << std::endl;
+            return ERROR;
+        }
+        iCurve->print("I-cache miss ratio curve", mrc_out);
+        mrc_out << std::endl;
+        dCurve->print("D-cache miss ratio curve", mrc_out);
+    }
+    // cache dumps carry the miss attribution of the L1s and the 3C split of every level
+    for (auto& level : getCacheLevels()) {
+        bool attributed = missAttributionEnabled && (level.second == iCache || level.second == dCache);
+        if (attributed || level.second->classifiesMisses()) {
+            level.second->dump(output + "_" + level.first);
+        }
+    }
+    if (!cacheSavePrefix.empty()) {
+        for (auto& level : getCacheLevels()) {
+            if (level.second->saveState(cacheSavePrefix + "_" + level.first + ".ckpt") != SUCCESS) {
+                return ERROR;
+            }
+        }
+    }
     return SUCCESS;
 }
\ No newline at end of file
@@ -1,13 +1,40 @@
 #pragma once
 #include <string>
+#include <vector>
 
 #include "cache.h"
 #include "Utilities.h"
 #include "simulator.h"
 
-// init the simulator and all info
+// init the simulator and all info, lowerLevels optionally configures a
+// unified L2 (and L3) shared by both L1 caches, and dramConfig (with channels
+// above 0) a DRAM timing model behind the last of them
 Status initSimulator(CacheConfig& icConfig, CacheConfig& dcConfig, MemoryStore* memory,
-                     const std::string& output_name);
+                     const std::string& output_name,
+                     const std::vector<CacheConfig>& lowerLevels = std::vector<CacheConfig>(),
+                     const DramConfig& dramConfig = DramConfig());
+
+// build single-pass miss ratio curves for both caches, written to
+// <output>_mrc.out by finalizeSimulator(); call before initSimulator()
+void enableMissRatioCurves();
+
+// split the misses of every cache into compulsory, capacity and conflict
+// misses in _sim_stats.out; call before initSimulator()
+void enableMissClassification();
+
+// count hits and misses per set and per PC in both caches, written to
+// <output>_icache_cache_state.out and <output>_dcache_cache_state.out by
+// finalizeSimulator(); call before initSimulator()
+void enableMissAttribution();
+
+// warm-start the caches from <loadPrefix>_<level>.ckpt in initSimulator() and
+// save them to <savePrefix>_<level>.ckpt in finalizeSimulator(), level being
+// icache, dcache, l2 and l3; an empty prefix skips that step
+void setCacheCheckpoints(const std::string& loadPrefix, const std::string& savePrefix);
+
+// fetch the first instruction from pc instead of 0, e.g. the entry point of an
+// ELF file
+void setEntryPoint(uint64_t pc);
 
 // run the simulator for a certain number of cycles
 Status runCycles(uint64_t cycles);
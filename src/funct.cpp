@@ -1,6 +1,8 @@
 #include "funct.h"
 
+#include <algorithm>
 #include <iostream>
+#include <sstream>
 
 #include "cache.h"
 #include "Utilities.h"
@@ -10,54 +12,105 @@ static Simulator* simulator = nullptr;
 static std::string output;
 static uint64_t PC = 0;
 
+static JitMode jitMode = JIT_OFF;
+// interpreter JIT_CHECK runs on a copy-on-write clone of the memory
+static Simulator* reference = nullptr;
+static uint64_t referencePC = 0;
+
+void setJitMode(JitMode mode) { jitMode = mode; }
+
 // initialize the simulator
 Status initSimulator(MemoryStore* mem, const std::string& output_name) {
     output = output_name;
     simulator = new Simulator();
     simulator->setMemory(mem);
+    if (jitMode != JIT_OFF) {
+        simulator->enableJit();
+    }
+    if (jitMode == JIT_CHECK) {
+        reference = new Simulator();
+        reference->setMemory(mem->clone().release());
+    }
     return SUCCESS;
 }
 
-// run the simulator for a certain number of intructions
+void setEntryPoint(uint64_t pc) {
+    PC = pc;
+    referencePC = pc;
+}
+
+// compare the simulator after it ran with status against the reference interpreter
+// after it ran with expected, reporting the first difference
+static bool matchesReference(Status status, Status expected) {
+    uint64_t din = simulator->getDin();
+    std::ostringstream values;
+    if (status != expected) {
+        values << "status " << status << " compiled, " << expected << " interpreted";
+    } else if (PC != referencePC) {
+        values << std::hex << "PC 0x" << PC << " compiled, 0x" << referencePC << " interpreted";
+    } else if (din != reference->getDin()) {
+        values << "din " << din << " compiled, " << reference->getDin() << " interpreted";
+    } else if (!simulator->getMemory()->sameContents(*reference->getMemory())) {
+        values << "memory differs";
+    } else {
+        for (int i = 0; i < NUM_REGS; i++) {
+            uint64_t value = simulator->getRegisters()[i];
+            uint64_t expectedValue = reference->getRegisters()[i];
+            if (value != expectedValue) {
+                values << std::hex << "x" << std::dec << i << std::hex << " 0x" << value
+                       << " compiled, 0x" << expectedValue << " interpreted";
+                break;
+            }
+        }
+    }
+    if (values.str().empty()) {
+        return true;
+    }
+    std::cerr << LOG_ERROR << "JIT check failed within the " << JIT_CHECK_INSTRUCTIONS
+              << " instructions before din " << din << ": " << values.str() << std::endl;
+    return false;
+}
+
+// run the simulator for a certain number of intructions (0 for no limit), through
+// the simulator's translated basic blocks
 // return SUCCESS if count of executed instructions == desired intructions.
 // return HALT if the simulator halts on 0xfeedfeed
 Status runInstructions(uint64_t instructions) {
+    if (!reference) {
+        return simulator->simBlocks(PC, instructions);
+    }
+    // JIT_CHECK runs both in lockstep
     uint64_t numInstructions = 0;
-    auto status = SUCCESS;
-
     while (instructions == 0 || numInstructions < instructions) {
-
-        Simulator::Instruction inst = simulator->simInstruction(PC);
-
-        numInstructions += 1;
-        PC = inst.nextPC;
-
-        if (inst.isHalt) {
-            status = HALT;
-            break;
+        uint64_t chunk = JIT_CHECK_INSTRUCTIONS;
+        if (instructions != 0) {
+            chunk = std::min(chunk, instructions - numInstructions);
         }
-
-        if (!inst.isLegal) {
-            status = ERROR;
-            break;
+        Status status = simulator->simBlocks(PC, chunk);
+        Status expected = reference->simBlocks(referencePC, chunk);
+        if (!matchesReference(status, expected)) {
+            return ERROR;
+        }
+        if (status != SUCCESS) {
+            return status;
         }
+        numInstructions += chunk;
     }
-    return status;
+    return SUCCESS;
 }
 
-// run till halt (call runInstructions() with instructions == 1 each time) until
+// run till halt (call runInstructions() with no instruction limit) until
 // status tells you to HALT or ERROR out
 Status runTillHalt() {
-    Status status;
-    while (true) {
-        status = static_cast<Status>(runInstructions(1));
-        if (status == HALT || status == ERROR) break;
-    }
-    return status;
+    return runInstructions(0);
 }
 
 // dump the stats of the simulator
 Status finalizeSimulator() {
+    if (reference) {
+        std::cout << LOG_INFO << "JIT check matched the interpreter over " << simulator->getDin()
+                  << " instructions" << std::endl;
+    }
     simulator->dumpRegMem(output);
     SimulationStats stats{simulator->getDin(), 0,};
     dumpSimStats(stats, output);
@@ -4,13 +4,26 @@
 #include "Utilities.h"
 #include "simulator.h"
 
+// how runInstructions runs blocks: interpreted, compiled to x86-64 once hot, or
+// compiled and checked against an interpreter running alongside
+enum JitMode { JIT_OFF, JIT_ON, JIT_CHECK };
+
+// instructions between the comparisons of JIT_CHECK
+#define JIT_CHECK_INSTRUCTIONS 4096
+
+// choose the JitMode, before initSimulator
+void setJitMode(JitMode mode);
+
 // init the simulator and all info
 Status initSimulator(MemoryStore* memory, const std::string& output_name);
 
-// run the simulator for a certain number of instructions
+// start execution at pc instead of 0, e.g. at the entry point of an ELF file
+void setEntryPoint(uint64_t pc);
+
+// run the simulator for a certain number of instructions (0 for no limit)
 Status runInstructions(uint64_t instructions);
 
-// run till halt (call runInstructions() with instructions == 1 each time) until
+// run till halt (call runInstructions() with no instruction limit) until
 // status tells you to HALT or ERROR out
 Status runTillHalt();
 
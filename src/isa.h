@@ -0,0 +1,273 @@
+#pragma once
+#include <stdint.h>
+
+#include "Utilities.h"
+
+// Decode tables generated at compile time from isaDescription below, the
+// single description of the RV64I subset the simulator runs. The decoder
+// (Simulator::simDecode) and the disassembler (getOpString and printInstr in
+// Utilities.cpp) both read them, so they agree on what is legal.
+
+// Instruction formats, which decide where the immediate comes from
+enum IsaFormat : uint8_t {
+    FORMAT_R = 0,
+    FORMAT_I,
+    FORMAT_S,
+    FORMAT_B,
+    FORMAT_U,
+    FORMAT_J,
+};
+
+// Operand usage and legality flags of an encoding
+enum IsaFlags : uint8_t {
+    ISA_LEGAL       = 1 << 0,
+    ISA_READS_RS1   = 1 << 1,
+    ISA_READS_RS2   = 1 << 2,
+    ISA_WRITES_RD   = 1 << 3,
+    ISA_READS_MEM   = 1 << 4,
+    ISA_WRITES_MEM  = 1 << 5,
+    ISA_ARITH_LOGIC = 1 << 6,
+};
+
+// What simArithLogic and simNextPCResolution do with an instruction; loads and
+// stores have none and go through simAddrGen and simMemAccess instead. Branches
+// and jumps come last, from EXEC_JAL on.
+enum ExecHandler : uint8_t {
+    EXEC_NONE = 0,
+    EXEC_ADD,
+    EXEC_SUB,
+    EXEC_SLL,
+    EXEC_SLT,
+    EXEC_SLTU,
+    EXEC_XOR,
+    EXEC_SRL,
+    EXEC_SRA,
+    EXEC_OR,
+    EXEC_AND,
+    EXEC_ADDW,
+    EXEC_SUBW,
+    EXEC_SLLW,
+    EXEC_SRLW,
+    EXEC_SRAW,
+    EXEC_LUI,
+    EXEC_AUIPC,
+    EXEC_JAL,
+    EXEC_JALR,
+    EXEC_BEQ,
+    EXEC_BNE,
+    EXEC_BLT,
+    EXEC_BGE,
+    EXEC_BLTU,
+    EXEC_BGEU,
+};
+
+// funct3 of encodings that do not have one
+#define FUNCT3_ANY 0xFF
+
+// Which bits of funct7 an encoding matches on: none, all of them, or all but
+// bit 25 which is shamt[5] of the RV64 immediate shifts
+#define F7_IGNORED 0x00
+#define F7_EXACT   0x7F
+#define F7_SHIFT   0x7E
+
+#define RR_ALU      (ISA_LEGAL | ISA_ARITH_LOGIC | ISA_WRITES_RD | ISA_READS_RS1 | ISA_READS_RS2)
+#define RI_ALU      (ISA_LEGAL | ISA_ARITH_LOGIC | ISA_WRITES_RD | ISA_READS_RS1)
+#define MEM_LOAD    (ISA_LEGAL | ISA_WRITES_RD | ISA_READS_RS1 | ISA_READS_MEM)
+#define MEM_STORE   (ISA_LEGAL | ISA_READS_RS1 | ISA_READS_RS2 | ISA_WRITES_MEM)
+#define COND_BRANCH (ISA_LEGAL | ISA_READS_RS1 | ISA_READS_RS2)
+#define UPPER_IMM   (ISA_LEGAL | ISA_ARITH_LOGIC | ISA_WRITES_RD)
+
+struct IsaDescription {
+    uint8_t opcode;
+    uint8_t funct3;
+    uint8_t funct7;
+    uint8_t funct7Mask;
+    IsaFormat format;
+    uint8_t flags;
+    ExecHandler handler;
+    const char* mnemonic;
+};
+
+// The first row matching an encoding describes it
+static constexpr IsaDescription isaDescription[] = {
+    // opcode    funct3       funct7          funct7Mask  format    flags        handler     mnemonic
+    {OP_INT,     FUNCT3_ADD,  FUNCT7_ADD,     F7_EXACT,   FORMAT_R, RR_ALU,      EXEC_ADD,   "add"},
+    {OP_INT,     FUNCT3_ADD,  FUNCT7_SUB,     F7_EXACT,   FORMAT_R, RR_ALU,      EXEC_SUB,   "sub"},
+    {OP_INT,     FUNCT3_SLL,  0,              F7_IGNORED, FORMAT_R, RR_ALU,      EXEC_SLL,   "sll"},
+    {OP_INT,     FUNCT3_SLT,  0,              F7_IGNORED, FORMAT_R, RR_ALU,      EXEC_SLT,   "slt"},
+    {OP_INT,     FUNCT3_SLTU, 0,              F7_IGNORED, FORMAT_R, RR_ALU,      EXEC_SLTU,  "sltu"},
+    {OP_INT,     FUNCT3_XOR,  0,              F7_IGNORED, FORMAT_R, RR_ALU,      EXEC_XOR,   "xor"},
+    {OP_INT,     FUNCT3_SR,   FUNCT7_LOGICAL, F7_SHIFT,   FORMAT_R, RR_ALU,      EXEC_SRL,   "srl"},
+    {OP_INT,     FUNCT3_SR,   FUNCT7_ARITH,   F7_SHIFT,   FORMAT_R, RR_ALU,      EXEC_SRA,   "sra"},
+    {OP_INT,     FUNCT3_OR,   0,              F7_IGNORED, FORMAT_R, RR_ALU,      EXEC_OR,    "or"},
+    {OP_INT,     FUNCT3_AND,  0,              F7_IGNORED, FORMAT_R, RR_ALU,      EXEC_AND,   "and"},
+
+    {OP_INTW,    FUNCT3_ADD,  FUNCT7_ADD,     F7_EXACT,   FORMAT_R, RR_ALU,      EXEC_ADDW,  "addw"},
+    {OP_INTW,    FUNCT3_ADD,  FUNCT7_SUB,     F7_EXACT,   FORMAT_R, RR_ALU,      EXEC_SUBW,  "subw"},
+    {OP_INTW,    FUNCT3_SLL,  0,              F7_IGNORED, FORMAT_R, RR_ALU,      EXEC_SLLW,  "sllw"},
+    {OP_INTW,    FUNCT3_SR,   FUNCT7_LOGICAL, F7_EXACT,   FORMAT_R, RR_ALU,      EXEC_SRLW,  "srlw"},
+    {OP_INTW,    FUNCT3_SR,   FUNCT7_ARITH,   F7_EXACT,   FORMAT_R, RR_ALU,      EXEC_SRAW,  "sraw"},
+
+    {OP_LOAD,    FUNCT3_B,    0,              F7_IGNORED, FORMAT_I, MEM_LOAD,    EXEC_NONE,  "lb"},
+    {OP_LOAD,    FUNCT3_H,    0,              F7_IGNORED, FORMAT_I, MEM_LOAD,    EXEC_NONE,  "lh"},
+    {OP_LOAD,    FUNCT3_W,    0,              F7_IGNORED, FORMAT_I, MEM_LOAD,    EXEC_NONE,  "lw"},
+    {OP_LOAD,    FUNCT3_D,    0,              F7_IGNORED, FORMAT_I, MEM_LOAD,    EXEC_NONE,  "ld"},
+    {OP_LOAD,    FUNCT3_BU,   0,              F7_IGNORED, FORMAT_I, MEM_LOAD,    EXEC_NONE,  "lbu"},
+    {OP_LOAD,    FUNCT3_HU,   0,              F7_IGNORED, FORMAT_I, MEM_LOAD,    EXEC_NONE,  "lhu"},
+    {OP_LOAD,    FUNCT3_WU,   0,              F7_IGNORED, FORMAT_I, MEM_LOAD,    EXEC_NONE,  "lwu"},
+
+    {OP_INTIMM,  FUNCT3_ADD,  0,              F7_IGNORED, FORMAT_I, RI_ALU,      EXEC_ADD,   "addi"},
+    {OP_INTIMM,  FUNCT3_SLL,  0,              F7_IGNORED, FORMAT_I, RI_ALU,      EXEC_SLL,   "slli"},
+    {OP_INTIMM,  FUNCT3_SLT,  0,              F7_IGNORED, FORMAT_I, RI_ALU,      EXEC_SLT,   "slti"},
+    {OP_INTIMM,  FUNCT3_SLTU, 0,              F7_IGNORED, FORMAT_I, RI_ALU,      EXEC_SLTU,  "sltui"},
+    {OP_INTIMM,  FUNCT3_XOR,  0,              F7_IGNORED, FORMAT_I, RI_ALU,      EXEC_XOR,   "xori"},
+    {OP_INTIMM,  FUNCT3_SR,   FUNCT7_LOGICAL, F7_SHIFT,   FORMAT_I, RI_ALU,      EXEC_SRL,   "srli"},
+    {OP_INTIMM,  FUNCT3_SR,   FUNCT7_ARITH,   F7_SHIFT,   FORMAT_I, RI_ALU,      EXEC_SRA,   "srai"},
+    {OP_INTIMM,  FUNCT3_OR,   0,              F7_IGNORED, FORMAT_I, RI_ALU,      EXEC_OR,    "ori"},
+    {OP_INTIMM,  FUNCT3_AND,  0,              F7_IGNORED, FORMAT_I, RI_ALU,      EXEC_AND,   "andi"},
+
+    {OP_INTIMMW, FUNCT3_ADD,  0,              F7_IGNORED, FORMAT_I, RI_ALU,      EXEC_ADDW,  "addiw"},
+    {OP_INTIMMW, FUNCT3_SLL,  0,              F7_IGNORED, FORMAT_I, RI_ALU,      EXEC_SLLW,  "slliw"},
+    {OP_INTIMMW, FUNCT3_SR,   FUNCT7_LOGICAL, F7_EXACT,   FORMAT_I, RI_ALU,      EXEC_SRLW,  "srliw"},
+    {OP_INTIMMW, FUNCT3_SR,   FUNCT7_ARITH,   F7_EXACT,   FORMAT_I, RI_ALU,      EXEC_SRAW,  "sraiw"},
+
+    {OP_JALR,    FUNCT3_ANY,  0,              F7_IGNORED, FORMAT_I, RI_ALU,      EXEC_JALR,  "jalr"},
+
+    {OP_STORE,   FUNCT3_B,    0,              F7_IGNORED, FORMAT_S, MEM_STORE,   EXEC_NONE,  "sb"},
+    {OP_STORE,   FUNCT3_H,    0,              F7_IGNORED, FORMAT_S, MEM_STORE,   EXEC_NONE,  "sh"},
+    {OP_STORE,   FUNCT3_W,    0,              F7_IGNORED, FORMAT_S, MEM_STORE,   EXEC_NONE,  "sw"},
+    {OP_STORE,   FUNCT3_D,    0,              F7_IGNORED, FORMAT_S, MEM_STORE,   EXEC_NONE,  "sd"},
+
+    {OP_BRANCH,  FUNCT3_BEQ,  0,              F7_IGNORED, FORMAT_B, COND_BRANCH, EXEC_BEQ,   "beq"},
+    {OP_BRANCH,  FUNCT3_BNE,  0,              F7_IGNORED, FORMAT_B, COND_BRANCH, EXEC_BNE,   "bne"},
+    {OP_BRANCH,  FUNCT3_BLT,  0,              F7_IGNORED, FORMAT_B, COND_BRANCH, EXEC_BLT,   "blt"},
+    {OP_BRANCH,  FUNCT3_BGE,  0,              F7_IGNORED, FORMAT_B, COND_BRANCH, EXEC_BGE,   "bge"},
+    {OP_BRANCH,  FUNCT3_BLTU, 0,              F7_IGNORED, FORMAT_B, COND_BRANCH, EXEC_BLTU,  "bltu"},
+    {OP_BRANCH,  FUNCT3_BGEU, 0,              F7_IGNORED, FORMAT_B, COND_BRANCH, EXEC_BGEU,  "bgeu"},
+
+    {OP_AUIPC,   FUNCT3_ANY,  0,              F7_IGNORED, FORMAT_U, UPPER_IMM,   EXEC_AUIPC, "auipc"},
+    {OP_LUI,     FUNCT3_ANY,  0,              F7_IGNORED, FORMAT_U, UPPER_IMM,   EXEC_LUI,   "lui"},
+    {OP_JAL,     FUNCT3_ANY,  0,              F7_IGNORED, FORMAT_J, UPPER_IMM,   EXEC_JAL,   "jal"},
+};
+
+#undef RR_ALU
+#undef RI_ALU
+#undef MEM_LOAD
+#undef MEM_STORE
+#undef COND_BRANCH
+#undef UPPER_IMM
+
+static constexpr int ISA_DESCRIPTIONS = sizeof(isaDescription) / sizeof(isaDescription[0]);
+// opcodes in the description plus the all-illegal row 0
+static constexpr int ISA_ROWS = 16;
+// distinct ways funct7 values match the description
+static constexpr int ISA_FUNCT7_CLASSES = 8;
+
+// A decoded encoding, what an instruction's opcode, funct3 and funct7 say
+struct IsaEntry {
+    uint8_t flags;
+    IsaFormat format;
+    ExecHandler handler;
+    const char* mnemonic;  // nullptr when illegal
+};
+
+// Decode is three loads: the row of the opcode, the class of funct7, and the
+// entry for the row, funct3 and class
+struct IsaTables {
+    uint8_t opcodeRow[128];
+    uint8_t funct7Class[128];
+    IsaEntry entries[ISA_ROWS][8][ISA_FUNCT7_CLASSES];
+};
+
+static constexpr bool isaMatches(const IsaDescription& desc, uint32_t opcode, uint32_t funct3,
+                                 uint32_t funct7) {
+    return desc.opcode == opcode && (desc.funct3 == FUNCT3_ANY || desc.funct3 == funct3) &&
+           (funct7 & desc.funct7Mask) == desc.funct7;
+}
+
+static constexpr IsaTables buildIsaTables() {
+    IsaTables tables{};
+    // the format of an illegal encoding is that of its opcode, so its immediate
+    // extracts the same way the decoder always has
+    IsaFormat rowFormat[ISA_ROWS] = {};
+    int rows = 1;
+    for (int i = 0; i < ISA_DESCRIPTIONS; i++) {
+        uint8_t opcode = isaDescription[i].opcode;
+        if (tables.opcodeRow[opcode] == 0) {
+            rowFormat[rows] = isaDescription[i].format;
+            tables.opcodeRow[opcode] = rows++;
+        }
+    }
+
+    // funct7 values that match the same masked descriptions share a class,
+    // classFunct7 holds the first value of each
+    uint64_t classSignature[ISA_FUNCT7_CLASSES] = {};
+    uint8_t classFunct7[ISA_FUNCT7_CLASSES] = {};
+    int classes = 0;
+    for (int funct7 = 0; funct7 < 128; funct7++) {
+        uint64_t signature = 0;
+        for (int i = 0; i < ISA_DESCRIPTIONS; i++) {
+            const IsaDescription& desc = isaDescription[i];
+            if (desc.funct7Mask != F7_IGNORED && (funct7 & desc.funct7Mask) == desc.funct7) {
+                signature |= 1ULL << i;
+            }
+        }
+        int found = classes;
+        for (int c = 0; c < classes; c++) {
+            if (classSignature[c] == signature) {
+                found = c;
+            }
+        }
+        if (found == classes) {
+            classSignature[classes] = signature;
+            classFunct7[classes] = funct7;
+            classes++;
+        }
+        tables.funct7Class[funct7] = found;
+    }
+
+    for (int opcode = 0; opcode < 128; opcode++) {
+        int row = tables.opcodeRow[opcode];
+        if (row == 0) {
+            continue;
+        }
+        for (int funct3 = 0; funct3 < 8; funct3++) {
+            for (int c = 0; c < classes; c++) {
+                IsaEntry entry = {0, rowFormat[row], EXEC_NONE, nullptr};
+                for (int i = ISA_DESCRIPTIONS - 1; i >= 0; i--) {
+                    const IsaDescription& desc = isaDescription[i];
+                    if (isaMatches(desc, opcode, funct3, classFunct7[c])) {
+                        entry = {desc.flags, desc.format, desc.handler, desc.mnemonic};
+                    }
+                }
+                tables.entries[row][funct3][c] = entry;
+            }
+        }
+    }
+    return tables;
+}
+
+static constexpr IsaTables isaTables = buildIsaTables();
+
+static_assert(ISA_DESCRIPTIONS <= 64, "funct7 class signatures hold one bit per description");
+
+inline const IsaEntry& lookupIsa(uint32_t opcode, uint32_t funct3, uint32_t funct7) {
+    return isaTables.entries[isaTables.opcodeRow[opcode & 0x7F]][funct3 & 0x7]
+                            [isaTables.funct7Class[funct7 & 0x7F]];
+}
+
+inline bool isControlTransfer(ExecHandler handler) {
+    return handler >= EXEC_JAL;
+}
+
+// One instruction of a translated block, what executing it needs of its decode
+struct MicroOp {
+    int32_t imm;
+    ExecHandler handler;
+    uint8_t flags;  // IsaFlags of the decoded instruction
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    uint8_t size;  // bytes a load or store accesses
+    bool signExtend;  // load sign-extends its value
+};
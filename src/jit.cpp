@@ -0,0 +1,411 @@
+#include "jit.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <initializer_list>
+
+#include "MemoryStore.h"
+
+// Compiled blocks follow the System V x86-64 calling convention. rbx holds the
+// Context and r12 the guest register file for the whole block; rax and rcx hold
+// the operands of an instruction, rax its result, and rdx the address or next PC.
+
+// host registers by encoding
+enum HostReg : uint8_t { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSI = 6, RDI = 7 };
+
+// x86 condition codes of setcc, cmovcc and jcc
+enum Condition : uint8_t {
+    COND_B = 0x2,
+    COND_AE = 0x3,
+    COND_BE = 0x6,
+    COND_E = 0x4,
+    COND_NE = 0x5,
+    COND_A = 0x7,
+    COND_L = 0xC,
+    COND_GE = 0xD,
+};
+#define JUMP_ALWAYS -1
+// bind() target standing for the end of the code so far
+#define BIND_HERE (~(size_t)0)
+
+// Appends machine code for one block, jumps within it patched once their target is
+// known
+class Emitter {
+   public:
+    std::vector<uint8_t> code;
+
+    void bytes(std::initializer_list<uint8_t> list) { code.insert(code.end(), list); }
+    void imm32(uint32_t value) {
+        for (int i = 0; i < 4; i++) code.push_back(value >> (8 * i));
+    }
+    void imm64(uint64_t value) {
+        for (int i = 0; i < 8; i++) code.push_back(value >> (8 * i));
+    }
+    // displacement of a Context field off rbx
+    void field(size_t offset) { code.push_back(offset); }
+
+    // mov reg, [r12 + x<index>] and mov [r12 + x<index>], rax
+    void loadGuest(HostReg reg, uint8_t index) {
+        bytes({0x49, 0x8B, (uint8_t)(0x84 | reg << 3), 0x24});
+        imm32(index * 8);
+    }
+    void storeGuest(uint8_t index) {
+        bytes({0x49, 0x89, 0x84, 0x24});
+        imm32(index * 8);
+    }
+    // mov reg, sign-extended imm32 and mov reg, imm64
+    void moveImm32(HostReg reg, int32_t value) {
+        bytes({0x48, 0xC7, (uint8_t)(0xC0 | reg)});
+        imm32(value);
+    }
+    void moveImm64(HostReg reg, uint64_t value) {
+        bytes({0x48, (uint8_t)(0xB8 | reg)});
+        imm64(value);
+    }
+    // jcc, or jmp for JUMP_ALWAYS, with a rel32 to bind later; returns where the rel32 is
+    size_t jump(int condition) {
+        if (condition == JUMP_ALWAYS) {
+            bytes({0xE9});
+        } else {
+            bytes({0x0F, (uint8_t)(0x80 | condition)});
+        }
+        imm32(0);
+        return code.size() - 4;
+    }
+    // point the jump whose rel32 is at `at` to target, here by default
+    void bind(size_t at, size_t target = BIND_HERE) {
+        uint32_t rel = (target == BIND_HERE ? code.size() : target) - (at + 4);
+        memcpy(&code[at], &rel, 4);
+    }
+    // add qword [rbx + executed], count; then the epilogue returning rax
+    void leave(uint64_t count) {
+        bytes({0x48, 0x81, 0x43});
+        field(offsetof(Jit::Context, executed));
+        imm32(count);
+        bytes({0x48, 0x83, 0xC4, 0x08,  // add rsp, 8
+               0x41, 0x5C,              // pop r12
+               0x5B,                    // pop rbx
+               0xC3});                  // ret
+    }
+    // rdx = host address of the load or store at guest address rax in the page cached
+    // at pageField and bytesField, or else one of the jumps added to misses: when the
+    // page misses, the access straddles its end or, for stores, overlaps code on it
+    void hostAddress(size_t pageField, size_t bytesField, uint64_t size, bool store,
+                     std::vector<size_t>& misses) {
+        bytes({0x48, 0x89, 0xC2,                 // mov rdx, rax
+               0x48, 0xC1, 0xEA, MEM_PAGE_BITS,  // shr rdx, MEM_PAGE_BITS
+               0x48, 0x3B, 0x53});               // cmp rdx, [rbx + page]
+        field(pageField);
+        misses.push_back(jump(COND_NE));
+        if (store) {
+            // fine below the code, or else at or above its end
+            bytes({0x48, 0x8D, 0x50, (uint8_t)size,  // lea rdx, [rax + size]
+                   0x48, 0x3B, 0x53});               // cmp rdx, [rbx + storeCodeStart]
+            field(offsetof(Jit::Context, storeCodeStart));
+            size_t below = jump(COND_BE);
+            bytes({0x48, 0x3B, 0x43});               // cmp rax, [rbx + storeCodeEnd]
+            field(offsetof(Jit::Context, storeCodeEnd));
+            misses.push_back(jump(COND_B));
+            bind(below);
+        }
+        bytes({0x89, 0xC2, 0x81, 0xE2});         // mov edx, eax; and edx, imm32
+        imm32(MEM_PAGE_SIZE - 1);
+        if (size > 1) {
+            bytes({0x81, 0xFA});                 // cmp edx, imm32
+            imm32(MEM_PAGE_SIZE - size);
+            misses.push_back(jump(COND_A));
+        }
+        bytes({0x48, 0x03, 0x53});               // add rdx, [rbx + bytes]
+        field(bytesField);
+    }
+};
+
+// rax = rax <handler> rcx, false for handlers without an arithmetic result here
+static bool emitArithLogic(Emitter& e, ExecHandler handler, uint64_t PC) {
+    switch (handler) {
+        case EXEC_ADD:
+            e.bytes({0x48, 0x01, 0xC8});
+            break;
+        case EXEC_SUB:
+            e.bytes({0x48, 0x29, 0xC8});
+            break;
+        case EXEC_SLL:
+            // x86 masks 64-bit shift counts to their low 6 bits like RV64I
+            e.bytes({0x48, 0xD3, 0xE0});
+            break;
+        case EXEC_SLT:
+        case EXEC_SLTU:
+            // cmp rax, rcx; setl/setb al; movzx eax, al
+            e.bytes({0x48, 0x39, 0xC8, 0x0F,
+                     (uint8_t)(0x90 | (handler == EXEC_SLT ? COND_L : COND_B)), 0xC0, 0x0F, 0xB6, 0xC0});
+            break;
+        case EXEC_XOR:
+            e.bytes({0x48, 0x31, 0xC8});
+            break;
+        case EXEC_SRL:
+            e.bytes({0x48, 0xD3, 0xE8});
+            break;
+        case EXEC_SRA:
+            e.bytes({0x48, 0xD3, 0xF8});
+            break;
+        case EXEC_OR:
+            e.bytes({0x48, 0x09, 0xC8});
+            break;
+        case EXEC_AND:
+            e.bytes({0x48, 0x21, 0xC8});
+            break;
+        // the word forms work on eax and sign-extend it with movsxd rax, eax; 32-bit
+        // shift counts are masked to their low 5 bits
+        case EXEC_ADDW:
+            e.bytes({0x01, 0xC8, 0x48, 0x63, 0xC0});
+            break;
+        case EXEC_SUBW:
+            e.bytes({0x29, 0xC8, 0x48, 0x63, 0xC0});
+            break;
+        case EXEC_SLLW:
+            e.bytes({0xD3, 0xE0, 0x48, 0x63, 0xC0});
+            break;
+        case EXEC_SRLW:
+            e.bytes({0xD3, 0xE8, 0x48, 0x63, 0xC0});
+            break;
+        case EXEC_SRAW:
+            e.bytes({0xD3, 0xF8, 0x48, 0x63, 0xC0});
+            break;
+        case EXEC_LUI:
+            e.bytes({0x48, 0x89, 0xC8});  // mov rax, rcx
+            break;
+        case EXEC_AUIPC:
+            e.moveImm64(RAX, PC);
+            e.bytes({0x48, 0x01, 0xC8});
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+// load or store at rax + imm of op, the value stored in rcx; a store leaves the block
+// with index + 1 instructions run when it overwrote the block
+static void emitMemAccess(Emitter& e, const MicroOp& op, uint64_t PC, uint64_t index) {
+    e.bytes({0x48, 0x05});  // add rax, imm32
+    e.imm32(op.imm);
+    std::vector<size_t> misses;
+    size_t done;
+    if (op.flags & ISA_READS_MEM) {
+        e.hostAddress(offsetof(Jit::Context, loadPage), offsetof(Jit::Context, loadBytes),
+                      op.size, false, misses);
+        switch (op.size) {
+            case BYTE_SIZE:
+                // movsx rax, byte [rdx] or movzx eax, byte [rdx]
+                if (op.signExtend) {
+                    e.bytes({0x48, 0x0F, 0xBE, 0x02});
+                } else {
+                    e.bytes({0x0F, 0xB6, 0x02});
+                }
+                break;
+            case HALF_SIZE:
+                if (op.signExtend) {
+                    e.bytes({0x48, 0x0F, 0xBF, 0x02});
+                } else {
+                    e.bytes({0x0F, 0xB7, 0x02});
+                }
+                break;
+            case WORD_SIZE:
+                // movsxd rax, dword [rdx] or mov eax, [rdx]
+                if (op.signExtend) {
+                    e.bytes({0x48, 0x63, 0x02});
+                } else {
+                    e.bytes({0x8B, 0x02});
+                }
+                break;
+            default:
+                e.bytes({0x48, 0x8B, 0x02});
+                break;
+        }
+        done = e.jump(JUMP_ALWAYS);
+        for (size_t miss : misses) e.bind(miss);
+        // load(context, address, size, signExtend)
+        e.bytes({0x48, 0x89, 0xDF, 0x48, 0x89, 0xC6, 0xBA});
+        e.imm32(op.size);
+        e.bytes({0xB9});
+        e.imm32(op.signExtend);
+        e.bytes({0xFF, 0x53});
+        e.field(offsetof(Jit::Context, load));
+        e.bind(done);
+        e.storeGuest(op.rd);
+        return;
+    }
+
+    e.hostAddress(offsetof(Jit::Context, storePage), offsetof(Jit::Context, storeBytes),
+                  op.size, true, misses);
+    switch (op.size) {
+        case BYTE_SIZE:
+            e.bytes({0x88, 0x0A});  // mov [rdx], cl
+            break;
+        case HALF_SIZE:
+            e.bytes({0x66, 0x89, 0x0A});
+            break;
+        case WORD_SIZE:
+            e.bytes({0x89, 0x0A});
+            break;
+        default:
+            e.bytes({0x48, 0x89, 0x0A});
+            break;
+    }
+    done = e.jump(JUMP_ALWAYS);
+    for (size_t miss : misses) e.bind(miss);
+    // store(context, address, value, size), leaving the block if it returns nonzero
+    e.bytes({0x48, 0x89, 0xDF, 0x48, 0x89, 0xC6, 0x48, 0x89, 0xCA, 0xB9});
+    e.imm32(op.size);
+    e.bytes({0xFF, 0x53});
+    e.field(offsetof(Jit::Context, store));
+    e.bytes({0x48, 0x85, 0xC0});  // test rax, rax
+    size_t stay = e.jump(COND_E);
+    e.moveImm64(RAX, PC + 4);
+    e.leave(index + 1);
+    e.bind(stay);
+    e.bind(done);
+}
+
+// rdx = PC after the branch or jump op
+static bool emitControlTransfer(Emitter& e, const MicroOp& op, uint64_t PC) {
+    switch (op.handler) {
+        case EXEC_JAL:
+            e.moveImm64(RDX, PC + op.imm);
+            break;
+        case EXEC_JALR:
+            e.bytes({0x48, 0x8D, 0x90});  // lea rdx, [rax + imm32]
+            e.imm32(op.imm);
+            e.bytes({0x48, 0x83, 0xE2, 0xFE});  // and rdx, ~1
+            break;
+        case EXEC_BEQ:
+        case EXEC_BNE:
+        case EXEC_BLT:
+        case EXEC_BGE:
+        case EXEC_BLTU:
+        case EXEC_BGEU: {
+            static const uint8_t conditions[] = {COND_E, COND_NE, COND_L, COND_GE, COND_B, COND_AE};
+            e.bytes({0x48, 0x39, 0xC8});  // cmp rax, rcx
+            e.moveImm64(RDX, PC + 4);
+            e.moveImm64(RSI, PC + op.imm);
+            // cmovcc rdx, rsi
+            e.bytes({0x48, 0x0F, (uint8_t)(0x40 | conditions[op.handler - EXEC_BEQ]), 0xD6});
+            break;
+        }
+        default:
+            return false;
+    }
+    return true;
+}
+
+Jit::Jit() {
+    void* mapped = mmap(nullptr, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped != MAP_FAILED) {
+        buffer = static_cast<uint8_t*>(mapped);
+    }
+}
+
+Jit::~Jit() {
+    if (buffer) {
+        munmap(buffer, JIT_BUFFER_SIZE);
+    }
+}
+
+Jit::BlockCode Jit::compile(uint64_t startPC, const std::vector<MicroOp>& ops) {
+#if !defined(__x86_64__)
+    // compiled code would not run here
+    return nullptr;
+#else
+    Emitter e;
+    e.bytes({0x53,                    // push rbx
+             0x41, 0x54,              // push r12
+             0x48, 0x83, 0xEC, 0x08,  // sub rsp, 8 to align calls
+             0x48, 0x89, 0xFB,        // mov rbx, rdi
+             0x4C, 0x8B, 0x63});      // mov r12, [rbx + regs]
+    e.field(offsetof(Context, regs));
+    e.bytes({0x48, 0xC7, 0x43});      // mov qword [rbx + executed], 0
+    e.field(offsetof(Context, executed));
+    e.imm32(0);
+    size_t top = e.code.size();
+
+    uint64_t PC = startPC;
+    bool transferred = false;
+    for (uint64_t index = 0; index < ops.size(); index++, PC += 4) {
+        const MicroOp& op = ops[index];
+        // operands as runBlock reads them, x0 as 0, with the immediate as op2 unless
+        // rs2 is read
+        if ((op.flags & ISA_READS_RS1) && op.rs1) {
+            e.loadGuest(RAX, op.rs1);
+        } else {
+            e.bytes({0x31, 0xC0});  // xor eax, eax
+        }
+        if (!(op.flags & ISA_READS_RS2)) {
+            e.moveImm32(RCX, op.imm);
+        } else if (op.rs2) {
+            e.loadGuest(RCX, op.rs2);
+        } else {
+            e.bytes({0x31, 0xC9});
+        }
+
+        if (op.flags & (ISA_READS_MEM | ISA_WRITES_MEM)) {
+            emitMemAccess(e, op, PC, index);
+        } else if (isControlTransfer(op.handler)) {
+            if (!emitControlTransfer(e, op, PC)) return nullptr;
+            // jumps link PC + 4
+            if (op.flags & ISA_WRITES_RD) {
+                if (op.flags & ISA_ARITH_LOGIC) {
+                    e.moveImm64(RAX, PC + 4);
+                } else {
+                    e.bytes({0x31, 0xC0});
+                }
+                e.storeGuest(op.rd);
+            }
+            e.bytes({0x48, 0x89, 0xD0});  // mov rax, rdx
+            transferred = true;
+            if (op.handler != EXEC_JALR && PC + op.imm == startPC) {
+                // a loop on itself goes round again while the budget has room for it
+                e.moveImm64(RSI, startPC);
+                e.bytes({0x48, 0x39, 0xF0});  // cmp rax, rsi
+                size_t exit = e.jump(COND_NE);
+                e.bytes({0x48, 0x81, 0x43});  // add qword [rbx + executed], imm32
+                e.field(offsetof(Context, executed));
+                e.imm32(ops.size());
+                e.bytes({0x48, 0x8B, 0x4B});  // mov rcx, [rbx + budget]
+                e.field(offsetof(Context, budget));
+                e.bytes({0x48, 0x2B, 0x4B});  // sub rcx, [rbx + executed]
+                e.field(offsetof(Context, executed));
+                e.bytes({0x48, 0x81, 0xF9});  // cmp rcx, imm32
+                e.imm32(ops.size());
+                e.bind(e.jump(COND_AE), top);
+                e.leave(0);
+                e.bind(exit);
+            }
+        } else if (op.flags & ISA_WRITES_RD) {
+            if (!(op.flags & ISA_ARITH_LOGIC)) {
+                e.bytes({0x31, 0xC0});
+            } else if (!emitArithLogic(e, op.handler, PC)) {
+                return nullptr;
+            }
+            e.storeGuest(op.rd);
+        }
+    }
+    if (!transferred) e.moveImm64(RAX, PC);
+    e.leave(ops.size());
+
+    // code is written with the pages it lands on writable, then made executable
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (!buffer || e.code.size() > JIT_BUFFER_SIZE - used) return nullptr;
+    uint8_t* start = buffer + used;
+    uint8_t* first = buffer + (used & ~(size_t)(pageSize - 1));
+    size_t length = start + e.code.size() - first;
+    if (mprotect(first, length, PROT_READ | PROT_WRITE) != 0) return nullptr;
+    memcpy(start, e.code.data(), e.code.size());
+    if (mprotect(first, length, PROT_READ | PROT_EXEC) != 0) return nullptr;
+    // keep the next block 16-byte aligned
+    used = (used + e.code.size() + 15) & ~(size_t)15;
+    return reinterpret_cast<BlockCode>(start);
+#endif
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "isa.h"
+
+// Compiles hot translated blocks (Simulator::Block) to x86-64 code in a buffer
+// mapped with mmap, for sim_funct --jit. Compiled code keeps guest registers in the
+// Simulator register file, accesses memory pages cached in Context directly and
+// calls back into the Simulator for every other access.
+
+// bytes of executable memory mapped for compiled blocks
+#define JIT_BUFFER_SIZE (16 << 20)
+// runs after which a block is compiled
+#define JIT_HOT_RUNS 16
+
+class Jit {
+   public:
+    // What compiled code reads and writes, addressed off a register it holds
+    struct Context {
+        uint64_t* regs = nullptr;
+        // one-entry caches of the host bytes of a guest page (address >> MEM_PAGE_BITS)
+        // for loads and for stores, ~0 if empty
+        uint64_t loadPage = ~0ULL;
+        uint8_t* loadBytes = nullptr;
+        uint64_t storePage = ~0ULL;
+        uint8_t* storeBytes = nullptr;
+        // instructions decoded from the store page, which stores to have to miss
+        uint64_t storeCodeStart = 0;
+        uint64_t storeCodeEnd = 0;
+        // accesses missing the pages above: load returns the value extended as the
+        // instruction does, store nonzero if it overwrote the running block
+        uint64_t (*load)(Context* context, uint64_t address, uint64_t size, uint64_t signExtend) = nullptr;
+        uint64_t (*store)(Context* context, uint64_t address, uint64_t value, uint64_t size) = nullptr;
+        void* owner = nullptr;
+        // instructions a compiled block may run, at least its length; a block that
+        // branches back to its start loops in compiled code while this allows
+        uint64_t budget = 0;
+        // instructions the last compiled block ran
+        uint64_t executed = 0;
+    };
+    // runs a compiled block and returns the PC after it
+    typedef uint64_t (*BlockCode)(Context* context);
+
+    Context context;
+
+    Jit();
+    ~Jit();
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    // compile the ops of the block at startPC, nullptr if one is unsupported, the
+    // buffer is full or the host can't run x86-64 code; the block leaves early after
+    // a store that overwrites it
+    BlockCode compile(uint64_t startPC, const std::vector<MicroOp>& ops);
+    // drop every compiled block
+    void reset() { used = 0; }
+
+   private:
+    uint8_t* buffer = nullptr;
+    size_t used = 0;
+};
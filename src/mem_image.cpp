@@ -0,0 +1,68 @@
+/** NOTE memory image converter
+ * Converts a text initial memory image (pairs of hex word address and value,
+ * as in init_mem_image) into the binary format prepareMemory() maps and copies
+ * in bulk. Consecutive words become a single range, and when words overlap the
+ * later one wins, as it does when the text is applied word by word.
+ */
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "MemoryStore.h"
+#include "Utilities.h"
+
+using namespace std;
+
+template <class T>
+static void writeLittleEndian(ofstream& out, T value) {
+    for (size_t i = 0; i < sizeof(T); i++) {
+        out.put(static_cast<char>((value >> (i * 8)) & 0xFF));
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        cerr << LOG_ERROR << "Usage: " << argv[0] << " <text image> <binary image>" << endl;
+        return ERROR;
+    }
+
+    ifstream text(argv[1]);
+    if (!text) {
+        cerr << LOG_ERROR << "Unable to open text image " << argv[1] << endl;
+        return ERROR;
+    }
+    map<uint64_t, uint8_t> bytes;
+    uint32_t addr, value;
+    while (text >> hex >> addr >> value) {
+        for (uint64_t i = 0; i < WORD_SIZE; i++) {
+            bytes[(uint64_t)addr + i] = (value >> (i * 8)) & 0xFF;
+        }
+    }
+    if (!text.eof()) {
+        cerr << LOG_ERROR << "Malformed text image " << argv[1] << endl;
+        return ERROR;
+    }
+
+    ofstream out(argv[2], ios::binary);
+    writeLittleEndian<uint32_t>(out, MEM_IMAGE_MAGIC);
+    writeLittleEndian<uint32_t>(out, MEM_IMAGE_VERSION);
+    uint64_t numRanges = 0;
+    for (auto it = bytes.begin(); it != bytes.end(); numRanges++) {
+        vector<char> payload;
+        uint64_t start = it->first;
+        for (; it != bytes.end() && it->first == start + payload.size(); ++it) {
+            payload.push_back(static_cast<char>(it->second));
+        }
+        writeLittleEndian<uint64_t>(out, start);
+        writeLittleEndian<uint64_t>(out, payload.size());
+        out.write(payload.data(), payload.size());
+    }
+    if (!out.flush()) {
+        cerr << LOG_ERROR << "Failed to write binary image " << argv[2] << endl;
+        return ERROR;
+    }
+    cout << LOG_INFO << "Wrote " << dec << bytes.size() << " bytes in " << numRanges << " ranges to "
+         << argv[2] << endl;
+    return SUCCESS;
+}
@@ -3,34 +3,29 @@
  * but we may use a different main() to grade, so do not put any simulation
  * logic here.
  */
+#include <algorithm>
+#include <cctype>
 #include <fstream>
 #include <iostream>
 #include <string>
 #include <tuple>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "cache.h"
+#include "ElfLoader.h"
 #include "MemoryStore.h"
 #include "Utilities.h"
 #include "cycle.h"
 
 using namespace std;
 
-inline std::tuple<std::string, CacheConfig, CacheConfig> parseArgs(int argc, char** argv) {
-    if (argc != 3) {
-        std::cerr << LOG_ERROR << "Usage: " << argv[0] << " <file.bin> <cache_config.txt>"
-                  << std::endl
-                  << "Note:" << std::endl
-                  << "The sim_cycle binary should take two command-line arguments indicating the "
-                     "name of the binary file to be read and the cache configuration file to be "
-                     "used. [See detail in project description document]."
-                  << std::endl;
-        exit(ERROR);
-    }
-
+// parse the L1 caches, optional lower levels and DRAM of a cache configuration file, exits on errors
+inline std::tuple<CacheConfig, CacheConfig, std::vector<CacheConfig>, DramConfig> parseCacheConfig(
+    const std::string& cacheFile) {
     try {
-        std::string inputFile = argv[1];
-        std::string cacheFile = argv[2];
-
         std::ifstream file(cacheFile);
         if (!file.is_open()) {
             std::cerr << LOG_ERROR << "Failed to open cache config file: " << cacheFile
@@ -53,16 +48,164 @@ inline std::tuple<std::string, CacheConfig, CacheConfig> parseArgs(int argc, cha
             return value;
         };
 
+        // optional lines after the four numbers of each cache, each starting with a word:
+        //   LRU | PLRU | FIFO | RANDOM | SRRIP | BIP   replacement policy (default LRU)
+        //   write-back | write-through                 write hit policy (default write-back)
+        //   write-allocate | no-write-allocate         write miss policy (default write-allocate)
+        //   store-miss-latency <cycles>                store miss latency (default miss latency)
+        //   write-latency <cycles>                     cost of each write to the next level (default 0)
+        //   inclusive | non-inclusive                  L2/L3 only (default non-inclusive)
+        //   prefetch next-line|stride <degree>         L1 prefetcher (default none)
+        //   mshrs <count>                              D-cache only: lockup-free with count MSHRs
+        //   victim <entries> <latency>                 victim cache and its hit latency (default none)
+        auto parseOptionLines = [&](const char* cacheName, CacheConfig& config) {
+            while ((file >> std::ws) && std::isalpha(file.peek())) {
+                line++;
+                std::string option;
+                file >> option;
+                std::string lower = option;
+                std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+                std::stringstream errorMessage;
+                errorMessage << "at line " << line << " for " << cacheName;
+
+                if (parsePolicyName(option, config.policy)) {
+                    if (config.policy == REPL_PLRU &&
+                        (config.ways > 64 || (config.ways & (config.ways - 1)) != 0)) {
+                        throw std::invalid_argument(
+                            "PLRU needs a power-of-two number of ways up to 64 " + errorMessage.str());
+                    }
+                } else if (lower == "write-back" || lower == "write-through") {
+                    config.writeBack = (lower == "write-back");
+                } else if (lower == "write-allocate" || lower == "no-write-allocate") {
+                    config.writeAllocate = (lower == "write-allocate");
+                } else if (lower == "inclusive" || lower == "non-inclusive") {
+                    config.inclusive = (lower == "inclusive");
+                } else if (lower == "prefetch") {
+                    std::string kind;
+                    uint32_t degree;
+                    if (!(file >> kind >> degree) || (kind != "next-line" && kind != "stride")) {
+                        throw std::invalid_argument(
+                            "Expected prefetch next-line|stride <degree> " + errorMessage.str());
+                    }
+                    config.prefetcher = (kind == "stride") ? PREFETCH_STRIDE : PREFETCH_NEXT_LINE;
+                    config.prefetchDegree = degree;
+                } else if (lower == "mshrs") {
+                    uint32_t count;
+                    if (!(file >> count) || count == 0) {
+                        throw std::invalid_argument("Expected mshrs <count> above 0 " +
+                                                    errorMessage.str());
+                    }
+                    if (std::string(cacheName) != "DCache") {
+                        throw std::invalid_argument("MSHRs are only modeled for the D-cache, " +
+                                                    errorMessage.str());
+                    }
+                    config.mshrs = count;
+                } else if (lower == "victim") {
+                    uint32_t entries, latency;
+                    if (!(file >> entries >> latency) || entries == 0) {
+                        throw std::invalid_argument("Expected victim <entries> <latency> " +
+                                                    errorMessage.str());
+                    }
+                    config.victimEntries = entries;
+                    config.victimLatency = latency;
+                } else if (lower == "store-miss-latency" || lower == "write-latency") {
+                    uint32_t value;
+                    if (!(file >> value)) {
+                        throw std::invalid_argument("Failed to parse " + lower + " " + errorMessage.str());
+                    }
+                    if (lower == "store-miss-latency") {
+                        config.storeMissLatency = value;
+                    } else {
+                        config.writeLatency = value;
+                    }
+                } else {
+                    throw std::invalid_argument("Unknown cache option \"" + option + "\" " +
+                                                errorMessage.str());
+                }
+                std::string discard;
+                std::getline(file, discard);  // discard rest of the line
+            }
+        };
+
         CacheConfig icConfig{parseNextLine("ICache cache size"), parseNextLine("ICache block size"),
                              parseNextLine("ICache ways"), parseNextLine("ICache miss latency")};
+        parseOptionLines("ICache", icConfig);
 
         CacheConfig dcConfig{parseNextLine("DCache cache size"), parseNextLine("DCache block size"),
                              parseNextLine("DCache ways"), parseNextLine("DCache miss latency")};
+        parseOptionLines("DCache", dcConfig);
 
         std::cout << LOG_INFO << LOG_VAR(icConfig) << std::endl;
         std::cout << LOG_INFO << LOG_VAR(dcConfig) << std::endl;
 
-        return std::make_tuple(inputFile, icConfig, dcConfig);
+        // optional lower levels, each a "[L2]" or "[L3]" line followed by the same
+        // four numbers and option lines as above; a miss in a level adds its miss latency
+        std::vector<CacheConfig> lowerLevels;
+        const char* levelNames[] = {"L2", "L3"};
+        // and an optional "[DRAM]" line last, followed by one number per line: channels,
+        // banks per channel, row size in bytes, tRCD, tCAS and tRP, and option lines
+        //   open-page | closed-page                    row buffer policy (default open-page)
+        //   burst <cycles>                             channel cycles per access (default 4)
+        // with it the miss latency of the last level only covers its own lookup
+        DramConfig dramConfig;
+        while ((file >> std::ws) && file.peek() == '[') {
+            line++;
+            std::string header;
+            file >> header;
+            if (header == "[DRAM]") {
+                std::string discard;
+                std::getline(file, discard);  // discard rest of the line
+                dramConfig.channels = parseNextLine("DRAM channels");
+                dramConfig.banks = parseNextLine("DRAM banks");
+                dramConfig.rowSize = parseNextLine("DRAM row size");
+                dramConfig.tRCD = parseNextLine("DRAM tRCD");
+                dramConfig.tCAS = parseNextLine("DRAM tCAS");
+                dramConfig.tRP = parseNextLine("DRAM tRP");
+                if (dramConfig.channels == 0 || dramConfig.banks == 0 || dramConfig.rowSize == 0) {
+                    throw std::invalid_argument("DRAM channels, banks and row size must be above 0");
+                }
+                while ((file >> std::ws) && std::isalpha(file.peek())) {
+                    line++;
+                    std::string option;
+                    file >> option;
+                    if (option == "open-page" || option == "closed-page") {
+                        dramConfig.openPage = (option == "open-page");
+                    } else if (option == "burst") {
+                        if (!(file >> dramConfig.burst)) {
+                            throw std::invalid_argument("Expected burst <cycles> at line " +
+                                                        std::to_string(line));
+                        }
+                    } else {
+                        throw std::invalid_argument("Unknown DRAM option \"" + option + "\" at line " +
+                                                    std::to_string(line));
+                    }
+                    std::getline(file, discard);  // discard rest of the line
+                }
+                std::cout << LOG_INFO << LOG_VAR(dramConfig) << std::endl;
+                if ((file >> std::ws) && !file.eof()) {
+                    throw std::invalid_argument("The [DRAM] section has to come last, line " +
+                                                std::to_string(line + 1));
+                }
+                break;
+            }
+            if (lowerLevels.size() == 2 ||
+                header != std::string("[") + levelNames[lowerLevels.size()] + "]") {
+                std::stringstream errorMessage;
+                errorMessage << "Unexpected cache level " << header << " at line " << line;
+                throw std::invalid_argument(errorMessage.str());
+            }
+            std::string discard;
+            std::getline(file, discard);  // discard rest of the line
+
+            const char* name = levelNames[lowerLevels.size()];
+            CacheConfig levelConfig{parseNextLine("cache size"), parseNextLine("block size"),
+                                    parseNextLine("ways"), parseNextLine("miss latency")};
+            parseOptionLines(name, levelConfig);
+            std::cout << LOG_INFO << name << " " << LOG_VAR(levelConfig) << std::endl;
+            lowerLevels.push_back(levelConfig);
+        }
+
+        return std::make_tuple(icConfig, dcConfig, lowerLevels, dramConfig);
 
     } catch (const std::invalid_argument& e) {
         std::cerr << LOG_ERROR << e.what() << std::endl;
@@ -73,16 +216,66 @@ inline std::tuple<std::string, CacheConfig, CacheConfig> parseArgs(int argc, cha
     }
 }
 
-int main(int argc, char** argv) {
-    auto simArgs = parseArgs(argc, argv);
-    auto inputFile = std::get<0>(simArgs);
-    auto iCacheConfig = std::get<1>(simArgs);
-    auto dCacheConfig = std::get<2>(simArgs);
+inline std::tuple<std::string, CacheConfig, CacheConfig, std::vector<CacheConfig>, DramConfig> parseArgs(
+    int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << LOG_ERROR << "Usage: " << argv[0] << " <file.bin|file.elf> <cache_config.txt> [options]"
+                  << std::endl
+                  << "Options:" << std::endl
+                  << "  --mrc    write LRU miss ratio curves for both caches to <file>_cycle_mrc.out"
+                  << std::endl
+                  << "  --3c     split the misses of every cache into compulsory, capacity and conflict"
+                  << std::endl
+                  << "           in the stats and in <file>_cycle_<level>_cache_state.out"
+                  << std::endl
+                  << "  --attribution  write per-set hits/misses and the top missing PCs of both caches"
+                  << std::endl
+                  << "                 to <file>_cycle_icache_cache_state.out and _dcache_cache_state.out"
+                  << std::endl
+                  << "  --load-cache <prefix>  start from the cache state in <prefix>_<level>.ckpt"
+                  << std::endl
+                  << "  --save-cache <prefix>  save the final cache state to <prefix>_<level>.ckpt"
+                  << std::endl
+                  << "  --memory-size <bytes>  size of the simulated memory (default 64 KB), pages are"
+                  << std::endl
+                  << "                         only allocated when written"
+                  << std::endl
+                  << "  --mem-image <file>     initial memory image, text or binary (repeatable,"
+                  << std::endl
+                  << "                         applied in order instead of ./init_mem_image)"
+                  << std::endl
+                  << "  --binary-mem-dump      dump memory raw to <file>_cycle_mem_state.bin with a"
+                  << std::endl
+                  << "                         checksum per page in _mem_state.sums instead of .out"
+                  << std::endl
+                  << "  --sweep <cache_config.txt>  also run with this configuration (repeatable), in a"
+                  << std::endl
+                  << "                              forked child sharing the loaded memory, writing"
+                  << std::endl
+                  << "                              <file>_cycle_<config>_* outputs"
+                  << std::endl
+                  << "Note:" << std::endl
+                  << "The sim_cycle binary should take two command-line arguments indicating the "
+                     "name of the binary file to be read and the cache configuration file to be "
+                     "used. [See detail in project description document]."
+                  << std::endl;
+        exit(ERROR);
+    }
 
-    cout << "[Simulator] Loading memory from " << LOG_VAR(inputFile) << endl;
-    auto baseFilename = getBaseFilename(argv[1]) + "_cycle";
-    initSimulator(iCacheConfig, dCacheConfig, new MemoryStore(0, MEMORY_SIZE, argv[1]),
-                  baseFilename);
+    auto configs = parseCacheConfig(argv[2]);
+    return std::make_tuple(std::string(argv[1]), std::get<0>(configs), std::get<1>(configs),
+                           std::get<2>(configs), std::get<3>(configs));
+}
+
+static Status runSimulation(CacheConfig& iCacheConfig, CacheConfig& dCacheConfig, MemoryStore* memory,
+                            const std::string& baseFilename,
+                            const std::vector<CacheConfig>& lowerLevels, const DramConfig& dramConfig,
+                            uint64_t entry) {
+    if (initSimulator(iCacheConfig, dCacheConfig, memory, baseFilename, lowerLevels, dramConfig) !=
+        SUCCESS) {
+        return ERROR;
+    }
+    setEntryPoint(entry);
 
     cout << "[Simulator] Start simulator" << endl;
     auto status = runTillHalt();
@@ -93,3 +286,95 @@ int main(int argc, char** argv) {
 
     return status;
 }
+
+int main(int argc, char** argv) {
+    auto simArgs = parseArgs(argc, argv);
+    auto inputFile = std::get<0>(simArgs);
+    auto iCacheConfig = std::get<1>(simArgs);
+    auto dCacheConfig = std::get<2>(simArgs);
+    auto lowerLevels = std::get<3>(simArgs);
+    auto dramConfig = std::get<4>(simArgs);
+
+    std::string cacheLoadPrefix, cacheSavePrefix;
+    std::vector<std::string> sweepConfigs, memoryImages;
+    uint64_t memorySize = MEMORY_SIZE;
+    for (int i = 3; i < argc; i++) {
+        std::string option = argv[i];
+        if ((option == "--load-cache" || option == "--save-cache") && i + 1 < argc) {
+            (option == "--load-cache" ? cacheLoadPrefix : cacheSavePrefix) = argv[++i];
+        } else if (option == "--memory-size" && i + 1 < argc) {
+            if (!parseMemorySize(argv[++i], memorySize)) {
+                cerr << LOG_ERROR << "Invalid memory size " << argv[i] << endl;
+                return ERROR;
+            }
+        } else if (option == "--mem-image" && i + 1 < argc) {
+            memoryImages.push_back(argv[++i]);
+        } else if (option == "--sweep" && i + 1 < argc) {
+            sweepConfigs.push_back(argv[++i]);
+        } else if (option == "--binary-mem-dump") {
+            enableBinaryMemoryDump();
+        } else if (option == "--mrc") {
+            enableMissRatioCurves();
+        } else if (option == "--3c") {
+            enableMissClassification();
+        } else if (option == "--attribution") {
+            enableMissAttribution();
+        } else {
+            cerr << LOG_ERROR << "Unknown option " << option << endl;
+            return ERROR;
+        }
+    }
+
+    if (!memoryImages.empty() && !setMemoryImages(memoryImages)) {
+        return ERROR;
+    }
+
+    cout << "[Simulator] Loading memory from " << LOG_VAR(inputFile) << endl;
+    auto baseFilename = getBaseFilename(argv[1]) + "_cycle";
+    setCacheCheckpoints(cacheLoadPrefix, cacheSavePrefix);
+    MemoryStore* memory;
+    ElfImage image;
+    if (isElfFile(argv[1])) {
+        memory = new MemoryStore(0, memorySize);
+        if (loadElf(argv[1], memory, image) != SUCCESS) {
+            return ERROR;
+        }
+        cout << LOG_INFO << "ELF entry 0x" << hex << image.entry << dec << ", "
+             << image.symbols.size() << " symbols" << endl;
+    } else {
+        memory = new MemoryStore(0, memorySize, argv[1]);
+    }
+
+    // Every sweep configuration runs in a child forked after the memory is loaded, so the
+    // children share its pages copy-on-write instead of reloading the program each.
+    bool sweepFailed = false;
+    for (const auto& config : sweepConfigs) {
+        std::string configName = getBaseFilename(config.substr(config.find_last_of('/') + 1).c_str());
+        cout << "[Simulator] Sweeping " << LOG_VAR(config) << endl;
+        cout.flush();
+        pid_t pid = fork();
+        if (pid < 0) {
+            cerr << LOG_ERROR << "Failed to fork for " << config << endl;
+            return ERROR;
+        }
+        if (pid == 0) {
+            auto configs = parseCacheConfig(config);
+            if (!cacheSavePrefix.empty()) {
+                setCacheCheckpoints(cacheLoadPrefix, cacheSavePrefix + "_" + configName);
+            }
+            exit(runSimulation(std::get<0>(configs), std::get<1>(configs), memory,
+                               baseFilename + "_" + configName, std::get<2>(configs),
+                               std::get<3>(configs), image.entry));
+        }
+        int childStatus = 0;
+        if (waitpid(pid, &childStatus, 0) != pid || !WIFEXITED(childStatus) ||
+            WEXITSTATUS(childStatus) == ERROR) {
+            cerr << LOG_ERROR << "Sweep with " << config << " failed" << endl;
+            sweepFailed = true;
+        }
+    }
+
+    auto status = runSimulation(iCacheConfig, dCacheConfig, memory, baseFilename, lowerLevels,
+                                dramConfig, image.entry);
+    return sweepFailed ? ERROR : status;
+}
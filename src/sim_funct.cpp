@@ -5,7 +5,10 @@
  */
 
 #include <iostream>
+#include <string>
+#include <vector>
 
+#include "ElfLoader.h"
 #include "MemoryStore.h"
 #include "Utilities.h"
 #include "funct.h"
@@ -14,13 +17,55 @@ using namespace std;
 
 int main(int argc, char** argv) {
     if (argc < 2) {
-        cerr << LOG_ERROR << "Usage: " << argv[0] << " <input_file>" << endl;
+        cerr << LOG_ERROR << "Usage: " << argv[0] << " <input_file> [--memory-size <bytes>]" << endl;
+        return ERROR;
+    }
+
+    uint64_t memorySize = MEMORY_SIZE;
+    vector<string> memoryImages;
+    for (int i = 2; i < argc; i++) {
+        string option = argv[i];
+        if (option == "--memory-size" && i + 1 < argc && parseMemorySize(argv[++i], memorySize)) {
+            continue;
+        }
+        if (option == "--mem-image" && i + 1 < argc) {
+            memoryImages.push_back(argv[++i]);
+            continue;
+        }
+        if (option == "--binary-mem-dump") {
+            enableBinaryMemoryDump();
+            continue;
+        }
+        if (option == "--jit") {
+            setJitMode(JIT_ON);
+            continue;
+        }
+        if (option == "--jit-check") {
+            setJitMode(JIT_CHECK);
+            continue;
+        }
+        cerr << LOG_ERROR << "Unknown or incomplete option " << option << endl;
+        return ERROR;
+    }
+    if (!memoryImages.empty() && !setMemoryImages(memoryImages)) {
         return ERROR;
     }
 
     cout << "[Simulator] Loading memory from " << LOG_VAR(argv[1]) << endl;
     auto baseFilename = getBaseFilename(argv[1]) + "_funct";
-    initSimulator(new MemoryStore(0, MEMORY_SIZE, argv[1]), baseFilename);
+    if (isElfFile(argv[1])) {
+        MemoryStore* memory = new MemoryStore(0, memorySize);
+        ElfImage image;
+        if (loadElf(argv[1], memory, image) != SUCCESS) {
+            return ERROR;
+        }
+        cout << LOG_INFO << "ELF entry 0x" << hex << image.entry << dec << ", "
+             << image.symbols.size() << " symbols" << endl;
+        initSimulator(memory, baseFilename);
+        setEntryPoint(image.entry);
+    } else {
+        initSimulator(new MemoryStore(0, memorySize, argv[1]), baseFilename);
+    }
 
     cout << "[Simulator] Start simulation" << endl;
     auto status = runTillHalt();
@@ -1,6 +1,7 @@
 #include "simulator.h"
 
 #include <stdio.h>
+#include <algorithm>
 #include <iostream>
 #include <stdexcept>
 using namespace std;
@@ -12,6 +13,7 @@ Simulator::Simulator() {
     memory = nullptr;
     regData.reg = {};
     din = 0;
+    decodedCache.resize(DECODED_CACHE_ENTRIES);
 }
 
 Simulator::~Simulator() {
@@ -38,8 +40,72 @@ Simulator::Instruction Simulator::simFetch(uint64_t PC, MemoryStore *myMem) {
     return inst;
 }
 
-// Determine instruction opcode, funct, reg names (but not calculate all imms)
-Simulator::Instruction Simulator::simDecode(Instruction inst) {
+// Determine instruction opcode, funct, reg names, the decoded fields of a cached
+// decode replace those of inst
+void Simulator::simDecode(Instruction& inst) {
+    DecodedEntry& entry = decodedCache[(inst.PC >> 2) & (DECODED_CACHE_ENTRIES - 1)];
+    if (entry.PC != inst.PC || entry.inst.instruction != inst.instruction) {
+        entry.PC = inst.PC;
+        entry.inst = Instruction();
+        entry.inst.PC = inst.PC;
+        entry.inst.instruction = inst.instruction;
+        decodeInstruction(entry.inst);
+    }
+    const Instruction& decoded = entry.inst;
+    inst.imm = decoded.imm;
+    inst.opcode = decoded.opcode;
+    inst.funct3 = decoded.funct3;
+    inst.funct7 = decoded.funct7;
+    inst.rd = decoded.rd;
+    inst.rs1 = decoded.rs1;
+    inst.rs2 = decoded.rs2;
+    inst.handler = decoded.handler;
+    inst.isHalt = decoded.isHalt;
+    inst.isLegal = decoded.isLegal;
+    inst.isNop = decoded.isNop;
+    inst.readsMem = decoded.readsMem;
+    inst.writesMem = decoded.writesMem;
+    inst.doesArithLogic = decoded.doesArithLogic;
+    inst.writesRd = decoded.writesRd;
+    inst.readsRs1 = decoded.readsRs1;
+    inst.readsRs2 = decoded.readsRs2;
+}
+
+void Simulator::fetchDecoded(uint64_t PC, Instruction& inst) {
+    DecodedEntry& entry = decodedCache[(PC >> 2) & (DECODED_CACHE_ENTRIES - 1)];
+    if (entry.PC == PC) {
+        inst = entry.inst;
+        return;
+    }
+    inst = simFetch(PC, memory);
+    decodeInstruction(inst);
+    // words that failed to fetch read as 0, which is illegal, and are not cached
+    // so the access violation is reported every time
+    if (inst.instruction != 0) {
+        entry.PC = PC;
+        entry.inst = inst;
+        // compiled stores to the word have to go through invalidateCode from now on
+        for (uint64_t page = PC >> MEM_PAGE_BITS; page <= (PC + 3) >> MEM_PAGE_BITS; page++) {
+            CodePage& code = codePages[page];
+            code.start = std::min(code.start, PC);
+            code.end = std::max(code.end, PC + 4);
+            if (jit && jit->context.storePage == page) jit->context.storePage = ~0ULL;
+        }
+    }
+}
+
+void Simulator::invalidateDecoded(uint64_t address, uint64_t size) {
+    // instructions are 4 bytes at even addresses, those from address - 3 on overlap
+    uint64_t first = (address - 3) & ~1ULL;
+    for (uint64_t PC = first; PC - first < address + size - first; PC += 2) {
+        DecodedEntry& entry = decodedCache[(PC >> 2) & (DECODED_CACHE_ENTRIES - 1)];
+        if (entry.PC == PC) {
+            entry.PC = ~0ULL;
+        }
+    }
+}
+
+void Simulator::decodeInstruction(Instruction& inst) {
     inst.opcode = extractBits(inst.instruction, 6, 0);
     inst.rd     = extractBits(inst.instruction, 11, 7);
     inst.funct3 = extractBits(inst.instruction, 14, 12);
@@ -47,363 +113,202 @@ Simulator::Instruction Simulator::simDecode(Instruction inst) {
     inst.rs2    = extractBits(inst.instruction, 24, 20);
     inst.funct7 = extractBits(inst.instruction, 31, 25);
 
-    inst.isLegal = true; // assume legal unless proven otherwise
-
-    if (inst.instruction == 0xfeedfeed) {
-        inst.isHalt = true;
-        return inst; // halt instruction
-    }
-    if (inst.instruction == 0x00000013) {
-        inst.isNop = true;
-        return inst; // NOP instruction
-    }
+    const IsaEntry& entry = lookupIsa(inst.opcode, inst.funct3, inst.funct7);
+    inst.handler = entry.handler;
 
-    switch (inst.opcode) {
-        case OP_INT:
-            if ((inst.funct3 == FUNCT3_ADD && (inst.funct7 == FUNCT7_ADD || inst.funct7 == FUNCT7_SUB)) || 
-                inst.funct3 == FUNCT3_SLL || inst.funct3 == FUNCT3_SLT || inst.funct3 == FUNCT3_SLTU ||
-                inst.funct3 == FUNCT3_XOR || (inst.funct3 == FUNCT3_SR && (inst.funct7 >> 1 == UPPERIMM_ARITH || 
-                inst.funct7 >> 1 == UPPERIMM_LOGICAL)) || inst.funct3 == FUNCT3_OR || inst.funct3 == FUNCT3_AND) {
-                inst.doesArithLogic = true;
-                inst.writesRd = true;
-                inst.readsRs1 = true;
-                inst.readsRs2 = true;
-            } else {
-                inst.isLegal = false;
-            }
+    // immediates, sign-extended once here instead of by every stage using them
+    uint64_t imm12 = extractBits(inst.instruction, 31, 20);
+    uint64_t imm20 = extractBits(inst.instruction, 31, 12);
+    switch (entry.format) {
+        case FORMAT_R:
             break;
-        case OP_INTW:
-            if ((inst.funct3 == FUNCT3_ADD && (inst.funct7 == FUNCT7_ADD || inst.funct7 == FUNCT7_SUB)) || 
-                inst.funct3 == FUNCT3_SLL || (inst.funct3 == FUNCT3_SR && (inst.funct7 == FUNCT7_ARITH || 
-                inst.funct7 == FUNCT7_LOGICAL))) {
-                inst.doesArithLogic = true;
-                inst.writesRd = true;
-                inst.readsRs1 = true;
-                inst.readsRs2 = true;
-            } else {
-                inst.isLegal = false;
-            }
+        case FORMAT_I:
+            inst.imm = sext64(imm12, 11);
             break;
-        case OP_LOAD:
-            if (inst.funct3 == FUNCT3_B || inst.funct3 == FUNCT3_H ||
-                inst.funct3 == FUNCT3_W || inst.funct3 == FUNCT3_D ||
-                inst.funct3 == FUNCT3_BU || inst.funct3 == FUNCT3_HU ||
-                inst.funct3 == FUNCT3_WU) {
-                inst.readsRs1 = true;
-                inst.writesRd = true;
-                inst.readsMem = true;
-            } else {
-                inst.isLegal = false;
-            }
+        case FORMAT_S:
+            inst.imm = sext64((inst.funct7 << 5) | inst.rd, 11);
             break;
-        case OP_INTIMM:
-            if (inst.funct3 == FUNCT3_ADD || inst.funct3 == FUNCT3_SLL || inst.funct3 == FUNCT3_SLT || 
-                inst.funct3 == FUNCT3_SLTU || inst.funct3 == FUNCT3_XOR || (inst.funct3 == FUNCT3_SR &&
-                (inst.funct7 >> 1 == UPPERIMM_ARITH || inst.funct7 >> 1 == UPPERIMM_LOGICAL)) ||
-                inst.funct3 == FUNCT3_OR || inst.funct3 == FUNCT3_AND) {
-                inst.doesArithLogic = true;
-                inst.writesRd = true;
-                inst.readsRs1 = true;
-            } else {
-                inst.isLegal = false;
-            }
+        case FORMAT_B:
+            inst.imm = sext64(
+                extractBits(inst.funct7, 6, 6) << 12 |
+                extractBits(inst.funct7, 5, 0) << 5 |
+                extractBits(inst.rd, 4, 1) << 1 |
+                extractBits(inst.rd, 0, 0) << 11,
+                12);
             break;
-        case OP_INTIMMW:
-            if (inst.funct3 == FUNCT3_ADD || inst.funct3 == FUNCT3_SLL ||
-                (inst.funct3 == FUNCT3_SR && (inst.funct7 == FUNCT7_ARITH || 
-                inst.funct7 == FUNCT7_LOGICAL))) {
-                inst.doesArithLogic = true;
-                inst.writesRd = true;
-                inst.readsRs1 = true;
-            } else {
-                inst.isLegal = false;
-            }
+        case FORMAT_J:
+            inst.imm = sext64(
+                extractBits(imm20, 19, 19) << 20 |
+                extractBits(imm20, 18, 9) << 1 |
+                extractBits(imm20, 8, 8) << 11 |
+                extractBits(imm20, 7, 0) << 12,
+                20);
             break;
-        case OP_JALR:
-            inst.isLegal = true;
-            inst.doesArithLogic = true;
-            inst.writesRd = true;
-            inst.readsRs1 = true;
-            break;
-        case OP_STORE:
-            if (inst.funct3 == FUNCT3_B || inst.funct3 == FUNCT3_H ||
-                inst.funct3 == FUNCT3_W || inst.funct3 == FUNCT3_D) {
-                inst.readsRs1 = true;
-                inst.readsRs2 = true;
-                inst.writesMem = true;
-            } else {
-                inst.isLegal = false;
-            }
-            break;
-        case OP_BRANCH:
-            if (inst.funct3 == FUNCT3_BEQ || inst.funct3 == FUNCT3_BNE ||
-                inst.funct3 == FUNCT3_BLT || inst.funct3 == FUNCT3_BGE ||
-                inst.funct3 == FUNCT3_BLTU || inst.funct3 == FUNCT3_BGEU) {
-                inst.readsRs1 = true;
-                inst.readsRs2 = true;
-            } else {
-                inst.isLegal = false;
-            }
+        case FORMAT_U:
+            inst.imm = sext64(imm20 << 12, 31);
             break;
-        case OP_AUIPC:
-        case OP_LUI:
-        case OP_JAL:
-            inst.isLegal = true;
-            inst.doesArithLogic = true;
-            inst.writesRd = true;
-            break;
-        default:
-            inst.isLegal = false;
     }
-    return inst;
+
+    inst.isLegal = true; // halt and NOP are legal without their flags
+
+    if (inst.instruction == 0xfeedfeed) {
+        inst.isHalt = true;
+        return; // halt instruction
+    }
+    if (inst.instruction == 0x00000013) {
+        inst.isNop = true;
+        return; // NOP instruction
+    }
+
+    inst.isLegal = entry.flags & ISA_LEGAL;
+    inst.readsRs1 = entry.flags & ISA_READS_RS1;
+    inst.readsRs2 = entry.flags & ISA_READS_RS2;
+    inst.writesRd = entry.flags & ISA_WRITES_RD;
+    inst.readsMem = entry.flags & ISA_READS_MEM;
+    inst.writesMem = entry.flags & ISA_WRITES_MEM;
+    inst.doesArithLogic = entry.flags & ISA_ARITH_LOGIC;
 }
 
-// Collect operands whether reg or imm for arith or addr gen
-Simulator::Instruction Simulator::simOperandCollection(Instruction inst, REGS regData) {
-    regData.registers[0] = 0;
+// Collect operands whether reg or imm for arith or addr gen, x0 reads as 0
+void Simulator::simOperandCollection(Instruction& inst, const REGS& regData) {
     if (inst.readsRs1) {
-        inst.op1Val = regData.registers[inst.rs1];
+        inst.op1Val = inst.rs1 ? regData.registers[inst.rs1] : 0;
     }
     if (inst.readsRs2) {
-        inst.op2Val = regData.registers[inst.rs2];
+        inst.op2Val = inst.rs2 ? regData.registers[inst.rs2] : 0;
     }
-    return inst;
 }
 
-// Resolve next PC whether +4 or branch/jump target taken/not taken
-Simulator::Instruction Simulator::simNextPCResolution(Instruction inst) {
-
-    uint64_t imm5   = inst.rd;
-    uint64_t imm7   = inst.funct7;
-    uint64_t imm12  = extractBits(inst.instruction, 31, 20);
-    uint64_t imm20  = extractBits(inst.instruction, 31, 12);
-    uint64_t branchTarget = inst.PC + sext64(
-        extractBits(imm7, 6, 6) << 12 |
-        extractBits(imm7, 5, 0) << 5 |
-        extractBits(imm5, 4, 1) << 1 |
-        extractBits(imm5, 0, 0) << 11,
-        12); // B-type immediate 
-    uint64_t jalTarget = inst.PC + sext64(
-        extractBits(imm20, 19, 19) << 20 |
-        extractBits(imm20, 18, 9) << 1 |
-        extractBits(imm20, 8, 8) << 11 |
-        extractBits(imm20, 7, 0) << 12,
-        20); // J-type immediate
-
-    switch (inst.opcode) {
-        case OP_JALR:
-            inst.nextPC = (inst.op1Val + sext64(imm12, 11)) & ~1ULL;
-            break;
-        case OP_BRANCH:
-            inst.nextPC = inst.PC + 4;
-            switch (inst.funct3) {
-                case FUNCT3_BEQ:
-                    if (inst.op1Val == inst.op2Val) {
-                        inst.nextPC = branchTarget;
-                    }
-                    break;
-                case FUNCT3_BNE:
-                    if (inst.op1Val != inst.op2Val) {
-                        inst.nextPC = branchTarget;
-                    }
-                    break;
-                case FUNCT3_BLT:
-                    if ((int64_t)inst.op1Val < (int64_t)inst.op2Val) {
-                        inst.nextPC = branchTarget;
-                    }
-                    break;
-                case FUNCT3_BGE:
-                    if ((int64_t)inst.op1Val >= (int64_t)inst.op2Val) {
-                        inst.nextPC = branchTarget;
-                    }
-                    break;
-                case FUNCT3_BLTU:
-                    if (inst.op1Val < inst.op2Val) {
-                        inst.nextPC = branchTarget;
-                    }
-                    break;
-                case FUNCT3_BGEU:
-                    if (inst.op1Val >= inst.op2Val) {
-                        inst.nextPC = branchTarget;
-                    }
-                    break;
-            }
+// Next PC of an instruction with handler at PC given its operands, shared by
+// simNextPCResolution and the block engine
+static inline uint64_t nextPCOf(ExecHandler handler, uint64_t PC, int64_t imm, uint64_t op1,
+                                uint64_t op2) {
+    bool taken = false;
+
+    switch (handler) {
+        case EXEC_JALR:
+            return (op1 + imm) & ~1ULL;
+        case EXEC_JAL:
+            return PC + imm;
+        case EXEC_BEQ:
+            taken = op1 == op2;
+            break;
+        case EXEC_BNE:
+            taken = op1 != op2;
+            break;
+        case EXEC_BLT:
+            taken = (int64_t)op1 < (int64_t)op2;
             break;
-        case OP_JAL:
-            inst.nextPC = jalTarget;
+        case EXEC_BGE:
+            taken = (int64_t)op1 >= (int64_t)op2;
+            break;
+        case EXEC_BLTU:
+            taken = op1 < op2;
+            break;
+        case EXEC_BGEU:
+            taken = op1 >= op2;
             break;
         default:
-            inst.nextPC = inst.PC + 4;
+            break;
     }
-
-    return inst;
+    return taken ? PC + imm : PC + 4;
 }
 
-// Perform arithmetic operations
-Simulator::Instruction Simulator::simArithLogic(Instruction inst) {
-    uint64_t imm12  = extractBits(inst.instruction, 31, 20);
-    uint64_t upperImm12 = extractBits(inst.instruction, 31, 26);
-    uint64_t imm20  = extractBits(inst.instruction, 31, 12);
-    
-    if (inst.opcode == OP_INT && (
-        inst.funct3 == FUNCT3_SLL || inst.funct3 == FUNCT3_SR)) {
-        // For SLL and SR, only low 6 bits of rs2 are considered in
-        // RV64I, so we mask it to 6 bits
-        inst.op2Val &= 0x3F;
-    } else if (inst.opcode == OP_INTW && (
-        inst.funct3 == FUNCT3_SLL || inst.funct3 == FUNCT3_SR)) {
-        // For SLLW and SRW, only low 5 bits of rs2 are considered in
-        // RV64I, so we mask it to 5 bits
-        inst.op2Val &= 0x1F;
-    }
-
-    switch (inst.opcode) {
-        case OP_INT:
-            switch (inst.funct3) {
-                case FUNCT3_ADD:
-                    if (inst.funct7 == FUNCT7_ADD) {
-                        inst.arithResult = inst.op1Val + inst.op2Val;
-                    } else if (inst.funct7 == FUNCT7_SUB) {
-                        inst.arithResult = inst.op1Val - inst.op2Val;
-                    }
-                    break;
-                case FUNCT3_SLL:
-                    inst.arithResult = inst.op1Val << inst.op2Val;
-                    break;
-                case FUNCT3_SLT:
-                    inst.arithResult = (int64_t)inst.op1Val < (int64_t)inst.op2Val;
-                    break;
-                case FUNCT3_SLTU:
-                    inst.arithResult = inst.op1Val < inst.op2Val;
-                    break;
-                case FUNCT3_XOR:
-                    inst.arithResult = inst.op1Val ^ inst.op2Val;
-                    break;
-                case FUNCT3_SR:
-                    if (upperImm12 == FUNCT7_LOGICAL) {
-                        inst.arithResult = inst.op1Val >> inst.op2Val;
-                    } else if (upperImm12 == UPPERIMM_ARITH) {
-                        inst.arithResult = (int64_t)inst.op1Val >> inst.op2Val;
-                    }
-                    break;
-                case FUNCT3_OR:
-                    inst.arithResult = inst.op1Val | inst.op2Val;
-                    break;
-                case FUNCT3_AND:
-                    inst.arithResult = inst.op1Val & inst.op2Val;
-                    break;
-                default:
-                    fprintf(stderr, "\tIllegal funct3\n");
-            }
+// Arithmetic result of handler into result, left alone for handlers without one;
+// op2 is rs2 for R-type instructions and the immediate otherwise
+static inline void arithLogicOf(ExecHandler handler, uint64_t PC, uint64_t op1, uint64_t op2,
+                                uint64_t& result) {
+    switch (handler) {
+        case EXEC_ADD:
+            result = op1 + op2;
             break;
-        case OP_INTW:
-            switch (inst.funct3) {
-                case FUNCT3_ADD:
-                    if (inst.funct7 == FUNCT7_ADD) {
-                        inst.arithResult = sext64((uint32_t)inst.op1Val + (uint32_t)inst.op2Val, 31);
-                    } else if (inst.funct7 == FUNCT7_SUB) {
-                        inst.arithResult = sext64((uint32_t)inst.op1Val - (uint32_t)inst.op2Val, 31);
-                    }
-                    break;
-                case FUNCT3_SLL:
-                    inst.arithResult = sext64((uint32_t)inst.op1Val << (uint32_t)inst.op2Val, 31);
-                    break;
-                case FUNCT3_SR:
-                    if (upperImm12 == FUNCT7_LOGICAL) {
-                        inst.arithResult = sext64((uint32_t)inst.op1Val >> (uint32_t)inst.op2Val, 31);
-                    } else if (upperImm12 == UPPERIMM_ARITH) {
-                        inst.arithResult = sext64((int32_t)inst.op1Val >> (uint32_t)inst.op2Val, 31);
-                    }
-                    break;
-            }
+        case EXEC_SUB:
+            result = op1 - op2;
             break;
-        case OP_INTIMM:
-            switch (inst.funct3) {
-                case FUNCT3_ADD:
-                    inst.arithResult = inst.op1Val + sext64(imm12, 11);
-                    break;
-                case FUNCT3_SLL:
-                    inst.arithResult = inst.op1Val << (imm12 & 0x3F);
-                    break;
-                case FUNCT3_SLT:
-                    inst.arithResult = (int64_t)inst.op1Val < (int64_t)sext64(imm12, 11);
-                    break;
-                case FUNCT3_SLTU:
-                    inst.arithResult = inst.op1Val < sext64(imm12, 11);
-                    break;
-                case FUNCT3_XOR:
-                    inst.arithResult = inst.op1Val ^ sext64(imm12, 11);
-                    break;
-                case FUNCT3_SR:
-                    if (upperImm12 == UPPERIMM_LOGICAL) {
-                        inst.arithResult = inst.op1Val >> (imm12 & 0x3F);
-                    } else if (upperImm12 == UPPERIMM_ARITH) {
-                        inst.arithResult = (int64_t)inst.op1Val >> (imm12 & 0x3F);
-                    }
-                    break;
-                case FUNCT3_OR:
-                    inst.arithResult = inst.op1Val | sext64(imm12, 11);
-                    break;
-                case FUNCT3_AND:
-                    inst.arithResult = inst.op1Val & sext64(imm12, 11);
-                    break;
-            }
+        case EXEC_SLL:
+            // only the low 6 bits of the shift amount count in RV64I
+            result = op1 << (op2 & 0x3F);
             break;
-        case OP_INTIMMW:
-            switch (inst.funct3) {
-                case FUNCT3_ADD:
-                    inst.arithResult = sext64((uint32_t)inst.op1Val + (uint32_t)sext32(imm12, 11), 31);
-                    break;
-                case FUNCT3_SLL:
-                    inst.arithResult = sext64((uint32_t)inst.op1Val << (uint32_t)(imm12 & 0x1F), 31);
-                    break;
-                case FUNCT3_SR:
-                    if (upperImm12 == UPPERIMM_LOGICAL) {
-                        inst.arithResult = sext64((uint32_t)inst.op1Val >> (uint32_t)(imm12 & 0x1F), 31);
-                    } else if (upperImm12 == UPPERIMM_ARITH) {
-                        inst.arithResult = sext64((int32_t)inst.op1Val >> (uint32_t)(imm12 & 0x1F), 31);
-                    }
-                    break;
-            }
+        case EXEC_SLT:
+            result = (int64_t)op1 < (int64_t)op2;
             break;
-        case OP_JALR:
-            inst.arithResult = inst.PC + 4;
+        case EXEC_SLTU:
+            result = op1 < op2;
             break;
-        case OP_AUIPC:
-            inst.arithResult = inst.PC + sext64(imm20 << 12, 31);
+        case EXEC_XOR:
+            result = op1 ^ op2;
             break;
-        case OP_LUI:
-            inst.arithResult = sext64(imm20 << 12, 31);
+        case EXEC_SRL:
+            result = op1 >> (op2 & 0x3F);
             break;
-        case OP_JAL:
-            inst.arithResult = inst.PC + 4;
+        case EXEC_SRA:
+            result = (int64_t)op1 >> (op2 & 0x3F);
+            break;
+        case EXEC_OR:
+            result = op1 | op2;
+            break;
+        case EXEC_AND:
+            result = op1 & op2;
+            break;
+        case EXEC_ADDW:
+            result = sext64((uint32_t)op1 + (uint32_t)op2, 31);
+            break;
+        case EXEC_SUBW:
+            result = sext64((uint32_t)op1 - (uint32_t)op2, 31);
+            break;
+        case EXEC_SLLW:
+            // and the low 5 bits for the word shifts
+            result = sext64((uint32_t)op1 << (uint32_t)(op2 & 0x1F), 31);
+            break;
+        case EXEC_SRLW:
+            result = sext64((uint32_t)op1 >> (uint32_t)(op2 & 0x1F), 31);
+            break;
+        case EXEC_SRAW:
+            result = sext64((int32_t)op1 >> (uint32_t)(op2 & 0x1F), 31);
+            break;
+        case EXEC_JAL:
+        case EXEC_JALR:
+            result = PC + 4;
+            break;
+        case EXEC_AUIPC:
+            result = PC + op2;
+            break;
+        case EXEC_LUI:
+            result = op2;
+            break;
+        default:
             break;
     }
+}
 
-    return inst;
+// Bytes a load or store with funct3 accesses
+static inline MemEntrySize accessSizeOf(uint64_t funct3) {
+    return (funct3 == FUNCT3_B || funct3 == FUNCT3_BU) ? BYTE_SIZE :
+           (funct3 == FUNCT3_H || funct3 == FUNCT3_HU) ? HALF_SIZE :
+           (funct3 == FUNCT3_W || funct3 == FUNCT3_WU) ? WORD_SIZE : DOUBLE_SIZE;
+}
+
+// Resolve next PC whether +4 or branch/jump target taken/not taken
+void Simulator::simNextPCResolution(Instruction& inst) {
+    inst.nextPC = nextPCOf(inst.handler, inst.PC, inst.imm, inst.op1Val, inst.op2Val);
+}
+
+// Perform arithmetic operations
+void Simulator::simArithLogic(Instruction& inst) {
+    uint64_t op2 = inst.readsRs2 ? inst.op2Val : (uint64_t)(int64_t)inst.imm;
+    arithLogicOf(inst.handler, inst.PC, inst.op1Val, op2, inst.arithResult);
 }
 
 // Generate memory address for load/store instructions
-Simulator::Instruction Simulator::simAddrGen(Instruction inst) {
-    uint64_t imm5   = inst.rd;
-    uint64_t imm7   = inst.funct7;
-    uint64_t imm12  = extractBits(inst.instruction, 31, 20);
-    int64_t storeImm = sext64((imm7 << 5) | imm5, 11); // S-type immediate
-    
-    if (inst.readsMem) {
-        inst.memAddress = inst.op1Val + sext64(imm12, 11);
-    } else if (inst.writesMem) {
-        inst.memAddress = inst.op1Val + storeImm;
+void Simulator::simAddrGen(Instruction& inst) {
+    if (inst.readsMem || inst.writesMem) {
+        inst.memAddress = inst.op1Val + inst.imm;
     }
-
-    return inst;
 }
 
 // Perform memory access for load/store instructions
-Simulator::Instruction Simulator::simMemAccess(Instruction inst, MemoryStore *myMem) {
-    MemEntrySize size = (inst.funct3 == FUNCT3_B || inst.funct3 == FUNCT3_BU) ? BYTE_SIZE :
-                    (inst.funct3 == FUNCT3_H || inst.funct3 == FUNCT3_HU) ? HALF_SIZE :
-                    (inst.funct3 == FUNCT3_W || inst.funct3 == FUNCT3_WU) ? WORD_SIZE : DOUBLE_SIZE;
+void Simulator::simMemAccess(Instruction& inst, MemoryStore *myMem) {
+    MemEntrySize size = accessSizeOf(inst.funct3);
     int memException = 0;
     if (inst.readsMem) {
         uint64_t value;
@@ -416,22 +321,23 @@ Simulator::Instruction Simulator::simMemAccess(Instruction inst, MemoryStore *my
         }
     } else if (inst.writesMem) {
         memException = myMem->setMemValue(inst.memAddress, inst.op2Val, size);
+        if (memException == 0) {
+            invalidateCode(inst.memAddress, size);
+        }
     }
     if (memException != 0) {
         // std::cout << "mem exception found in simMemAccess: "  << inst.PC << std::endl;
         inst.memException = true;
     }
-    return inst;
 }
 
 // Write back results to registers
-Simulator::Instruction Simulator::simCommit(Instruction inst, REGS &regData) {
+void Simulator::simCommit(Instruction& inst, REGS &regData) {
     if (inst.readsMem) {
         regData.registers[inst.rd] = inst.memResult;
     } else {
         regData.registers[inst.rd] = inst.arithResult;
     }
-    return inst;
 }
 
 // TODO complete the following pipeline stage simulation functions
@@ -443,63 +349,285 @@ Simulator::Instruction Simulator::simIF(uint64_t PC) {
     return simFetch(PC, memory); 
 }
 
-Simulator::Instruction Simulator::simID(Simulator::Instruction inst) {
+void Simulator::simID(Simulator::Instruction& inst) {
     // throw std::runtime_error("simID not implemented yet"); // TODO implement ID
-    inst = simDecode(inst);
-    inst = simOperandCollection(inst, regData);
+    simDecode(inst);
+    simOperandCollection(inst, regData);
     // cout << "[Simulator] reached decode: " << endl;
-    return simNextPCResolution(inst);
+    simNextPCResolution(inst);
 }
 
-Simulator::Instruction Simulator::simEX(Simulator::Instruction inst) {
+void Simulator::simEX(Simulator::Instruction& inst) {
     // throw std::runtime_error("simEX not implemented yet"); // TODO implement EX
-    inst = simArithLogic(inst);
+    simArithLogic(inst);
     // cout << "[Simulator] reached execute: " << endl;
     // if (inst.PC == 0x24) {
     //     cout << "execute arith result for PC 0x24: " << inst.arithResult << endl;
     //     cout << "execute rs1 for PC 0x24: " << inst.op1Val << endl;
     //     cout << "execute rs2 for PC 0x24: " << inst.op2Val << endl;
     // }
-    return simAddrGen(inst);
+    simAddrGen(inst);
 }
 
-Simulator::Instruction Simulator::simMEM(Simulator::Instruction inst) {
+void Simulator::simMEM(Simulator::Instruction& inst) {
     // throw std::runtime_error("simMEM not implemented yet"); // TODO implement MEM
     // cout << "[Simulator] reached mem: " << endl;
     if (inst.isHalt || !inst.isLegal) {
-        return inst;
+        return;
     }
-    return simMemAccess(inst, memory);
+    simMemAccess(inst, memory);
 }
 
-Simulator::Instruction Simulator::simWB(Simulator::Instruction inst) {
+void Simulator::simWB(Simulator::Instruction& inst) {
     // throw std::runtime_error("simWB not implemented yet"); // TODO implement WB
     // cout << "[Simulator] reached writeback: "  << inst.instruction << endl;
     if (!inst.isNop) {
         din += 1;
     }
     if (inst.isHalt || !inst.isLegal) {
-        return inst;
+        return;
     }
-    return simCommit(inst, regData);
+    simCommit(inst, regData);
 }
 
 
 // Simulate the whole instruction using functions above
 Simulator::Instruction Simulator::simInstruction(uint64_t PC) {
     // Implementation moved from .cpp to .h for illustration
-    Instruction inst = simFetch(PC, memory);
-    inst = simDecode(inst);
-    inst.instructionID = din++;
+    Instruction inst;
+    fetchDecoded(PC, inst);
+    din++;
     if (!inst.isLegal || inst.isHalt) return inst;
-    inst = simOperandCollection(inst, regData);
-    inst = simNextPCResolution(inst);
-    if (inst.doesArithLogic) inst = simArithLogic(inst);
+    simOperandCollection(inst, regData);
+    simNextPCResolution(inst);
+    if (inst.doesArithLogic) simArithLogic(inst);
     if (inst.readsMem || inst.writesMem) {
-        inst = simAddrGen(inst);
-        inst = simMemAccess(inst, memory);
+        simAddrGen(inst);
+        simMemAccess(inst, memory);
     }
-    if (inst.writesRd) inst = simCommit(inst, regData);
-    PC = inst.nextPC;
+    if (inst.writesRd) simCommit(inst, regData);
     return inst;
-}
\ No newline at end of file
+}
+
+void Simulator::invalidateCode(uint64_t address, uint64_t size) {
+    invalidateDecoded(address, size);
+    // the store may have copied a page shared with a clone, away from the one cached
+    uint64_t firstPage = address >> MEM_PAGE_BITS;
+    uint64_t lastPage = (address + size - 1) >> MEM_PAGE_BITS;
+    if (jit && jit->context.loadPage - firstPage <= lastPage - firstPage) {
+        jit->context.loadPage = ~0ULL;
+    }
+    if (recording && address < recording->startPC + 4 * (recording->ops.size() + 1) &&
+        address + size > recording->startPC) {
+        recordingOverwritten = true;
+    }
+    if (address >= codeEnd || address + size <= codeStart) return;
+    for (uint64_t page = firstPage; page <= lastPage; page++) {
+        auto it = codePages.find(page);
+        if (it == codePages.end()) continue;
+        for (Block* block : it->second.blocks) {
+            if (block->valid && address < block->endPC && address + size > block->startPC) {
+                block->valid = false;
+                blocks.erase(block->startPC);
+                invalidBlocks++;
+            }
+        }
+    }
+}
+
+void Simulator::flushCode() {
+    decodedCache.assign(DECODED_CACHE_ENTRIES, DecodedEntry());
+    blocks.clear();
+    allBlocks.clear();
+    codePages.clear();
+    codeStart = ~0ULL;
+    codeEnd = 0;
+    invalidBlocks = 0;
+    if (jit) jit->reset();
+}
+
+Status Simulator::stepInstruction(uint64_t& PC) {
+    Instruction inst = simInstruction(PC);
+    PC = inst.nextPC;
+    if (inst.isHalt) return HALT;
+    if (!inst.isLegal) return ERROR;
+    return SUCCESS;
+}
+
+Status Simulator::recordBlock(uint64_t& PC, uint64_t remaining, uint64_t& executed) {
+    std::unique_ptr<Block> block(new Block());
+    block->startPC = PC;
+    recording = block.get();
+    recordingOverwritten = false;
+
+    Status status = SUCCESS;
+    for (uint64_t count = 0; remaining == 0 || count < remaining; ) {
+        Instruction inst = simInstruction(PC);
+        count++;
+        executed++;
+        PC = inst.nextPC;
+        // halts and illegal instructions stay out of blocks, always executed singly
+        if (inst.isHalt) {
+            status = HALT;
+            break;
+        }
+        if (!inst.isLegal) {
+            status = ERROR;
+            break;
+        }
+        MicroOp op;
+        op.imm = inst.imm;
+        op.handler = inst.handler;
+        op.flags = (inst.readsRs1 ? ISA_READS_RS1 : 0) | (inst.readsRs2 ? ISA_READS_RS2 : 0) |
+                   (inst.writesRd ? ISA_WRITES_RD : 0) | (inst.readsMem ? ISA_READS_MEM : 0) |
+                   (inst.writesMem ? ISA_WRITES_MEM : 0) |
+                   (inst.doesArithLogic ? ISA_ARITH_LOGIC : 0);
+        op.rd = inst.rd;
+        op.rs1 = inst.rs1;
+        op.rs2 = inst.rs2;
+        op.size = accessSizeOf(inst.funct3);
+        op.signExtend = inst.funct3 == FUNCT3_B || inst.funct3 == FUNCT3_H ||
+                        inst.funct3 == FUNCT3_W;
+        block->ops.push_back(op);
+        if (isControlTransfer(inst.handler) || block->ops.size() == MAX_BLOCK_INSTRUCTIONS) break;
+    }
+    recording = nullptr;
+    if (block->ops.empty() || recordingOverwritten) return status;
+
+    block->endPC = block->startPC + 4 * block->ops.size();
+    codeStart = std::min(codeStart, block->startPC);
+    codeEnd = std::max(codeEnd, block->endPC);
+    uint64_t lastPage = (block->endPC - 1) >> MEM_PAGE_BITS;
+    for (uint64_t page = block->startPC >> MEM_PAGE_BITS; page <= lastPage; page++) {
+        codePages[page].blocks.push_back(block.get());
+    }
+    blocks[block->startPC] = block.get();
+    allBlocks.push_back(std::move(block));
+    return status;
+}
+
+Simulator::Block* Simulator::runBlock(Block* block, uint64_t& PC, uint64_t remaining,
+                                      uint64_t& executed) {
+    uint64_t nextPC = block->endPC;
+    if (jit && !block->code && ++block->runs == JIT_HOT_RUNS) {
+        // stays interpreted if it can't be compiled
+        block->code = jit->compile(block->startPC, block->ops);
+    }
+    if (block->code) {
+        jitBlock = block;
+        jit->context.budget = remaining == 0 ? ~0ULL : remaining;
+        nextPC = block->code(&jit->context);
+        din += jit->context.executed;
+        executed += jit->context.executed;
+    } else {
+        uint64_t* regs = regData.registers;
+        uint64_t opPC = block->startPC;
+        for (const MicroOp& op : block->ops) {
+            din++;
+            executed++;
+            uint64_t op1 = op.rs1 ? regs[op.rs1] : 0;
+            uint64_t op2 = op.rs2 ? regs[op.rs2] : 0;
+            if (op.flags & ISA_READS_MEM) {
+                uint64_t value;
+                memory->getMemValue(op1 + op.imm, value, (MemEntrySize)op.size);
+                regs[op.rd] = op.signExtend ? sext64(value, op.size * 8 - 1) : value;
+            } else if (op.flags & ISA_WRITES_MEM) {
+                uint64_t address = op1 + op.imm;
+                if (memory->setMemValue(address, op2, (MemEntrySize)op.size) == 0) {
+                    invalidateCode(address, op.size);
+                    if (!block->valid) {
+                        nextPC = opPC + 4;
+                        break;
+                    }
+                }
+            } else {
+                uint64_t result = 0;
+                if (isControlTransfer(op.handler)) nextPC = nextPCOf(op.handler, opPC, op.imm, op1, op2);
+                if (op.flags & ISA_ARITH_LOGIC) {
+                    arithLogicOf(op.handler, opPC, op1,
+                                 (op.flags & ISA_READS_RS2) ? op2 : (uint64_t)(int64_t)op.imm, result);
+                }
+                if (op.flags & ISA_WRITES_RD) regs[op.rd] = result;
+            }
+            opPC += 4;
+        }
+    }
+
+    PC = nextPC;
+    // the block overwrote itself, go on from the next instruction afresh
+    if (!block->valid) return nullptr;
+    Block::Exit& exit = block->exits[nextPC == block->endPC ? 1 : 0];
+    if (exit.PC == nextPC && exit.block->valid) return exit.block;
+    auto it = blocks.find(nextPC);
+    if (it == blocks.end()) return nullptr;
+    exit.PC = nextPC;
+    exit.block = it->second;
+    return exit.block;
+}
+
+void Simulator::enableJit() {
+    jit.reset(new Jit());
+    jit->context.regs = regData.registers;
+    jit->context.load = jitLoad;
+    jit->context.store = jitStore;
+    jit->context.owner = this;
+}
+
+uint64_t Simulator::jitLoad(Jit::Context* context, uint64_t address, uint64_t size,
+                            uint64_t signExtend) {
+    Simulator* simulator = static_cast<Simulator*>(context->owner);
+    uint64_t value;
+    simulator->memory->getMemValue(address, value, (MemEntrySize)size);
+    uint8_t* bytes = simulator->memory->pageBytes(address, false);
+    if (bytes) {
+        context->loadPage = address >> MEM_PAGE_BITS;
+        context->loadBytes = bytes;
+    }
+    return signExtend ? sext64(value, size * 8 - 1) : value;
+}
+
+uint64_t Simulator::jitStore(Jit::Context* context, uint64_t address, uint64_t value,
+                             uint64_t size) {
+    Simulator* simulator = static_cast<Simulator*>(context->owner);
+    if (simulator->memory->setMemValue(address, value, (MemEntrySize)size) != 0) return 0;
+    simulator->invalidateCode(address, size);
+    if (!simulator->jitBlock->valid) return 1;
+    uint8_t* bytes = simulator->memory->pageBytes(address, true);
+    if (bytes) {
+        uint64_t page = address >> MEM_PAGE_BITS;
+        auto it = simulator->codePages.find(page);
+        context->storePage = page;
+        context->storeBytes = bytes;
+        context->storeCodeStart = it == simulator->codePages.end() ? 0 : it->second.start;
+        context->storeCodeEnd = it == simulator->codePages.end() ? 0 : it->second.end;
+    }
+    return 0;
+}
+
+Status Simulator::simBlocks(uint64_t& PC, uint64_t instructions) {
+    uint64_t executed = 0;
+    Block* block = nullptr;
+    while (instructions == 0 || executed < instructions) {
+        uint64_t remaining = instructions == 0 ? 0 : instructions - executed;
+        if (!block) {
+            if (invalidBlocks > MAX_INVALID_BLOCKS) flushCode();
+            auto it = blocks.find(PC);
+            if (it == blocks.end()) {
+                Status status = recordBlock(PC, remaining, executed);
+                if (status != SUCCESS) return status;
+                continue;
+            }
+            block = it->second;
+        }
+        if (remaining != 0 && block->ops.size() > remaining) {
+            // too few instructions left for the whole block, finish them singly
+            block = nullptr;
+            Status status = stepInstruction(PC);
+            executed++;
+            if (status != SUCCESS) return status;
+            continue;
+        }
+        block = runBlock(block, PC, remaining, executed);
+    }
+    return SUCCESS;
+}
@@ -1,11 +1,25 @@
 #pragma once
 
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "Utilities.h"
 #include "MemoryStore.h"
+#include "isa.h"
+#include "jit.h"
 #include "RegisterInfo.h"
 
+// entries of the decoded instruction cache, a power of two
+#define DECODED_CACHE_ENTRIES 1024
+
+// longest basic block the block engine translates
+#define MAX_BLOCK_INSTRUCTIONS 64
+// invalidated blocks kept for chain pointers that may still reach them, above
+// which the block engine drops every block and starts over
+#define MAX_INVALID_BLOCKS 1024
+
 class Simulator {
    private:
     union REGS {
@@ -25,12 +39,38 @@ class Simulator {
     Simulator();
     ~Simulator();
 
+    // One instruction in flight, ordered widest field first so it packs into
+    // 88 bytes. Stages update it in place.
     struct Instruction {
         // known by IF
         uint64_t PC = 0;
-        uint64_t instruction = 0;    // raw instruction encoding
 
         // known by ID
+        uint64_t nextPC = 0;
+        uint64_t op1Val = 0;
+        uint64_t op2Val = 0;
+
+        // known by EX
+        uint64_t arithResult = 0;
+        uint64_t memAddress = 0;
+
+        // known by MEM
+        uint64_t memResult = 0;
+
+        // known by IF
+        uint32_t instruction = 0;    // raw instruction encoding
+
+        // known by ID
+        int32_t  imm = 0;            // sign-extended immediate of the instruction's format
+
+        uint8_t  opcode = 0;
+        uint8_t  funct3 = 0;
+        uint8_t  funct7 = 0;
+        uint8_t  rd = 0;
+        uint8_t  rs1 = 0;
+        uint8_t  rs2 = 0;
+        ExecHandler handler = EXEC_NONE;
+
         bool     isHalt = false;
         bool     isLegal = false;
         bool     isNop = false;
@@ -42,60 +82,130 @@ class Simulator {
         bool     readsRs1 = false;
         bool     readsRs2 = false;
 
-        uint64_t opcode = 0;
-        uint64_t funct3 = 0;
-        uint64_t funct7 = 0;
-        uint64_t rd = 0;
-        uint64_t rs1 = 0;
-        uint64_t rs2 = 0;
-
-        uint64_t nextPC = 0;
-
-        uint64_t op1Val = 0;
-        uint64_t op2Val = 0;
-
-
-        // known by EX
-        uint64_t arithResult = 0;
-        uint64_t memAddress = 0;
-
         // known by MEM
         bool     memException = false;
-        uint64_t memResult = 0;
-        uint64_t valToWrite = 0;
-
-        // known by WB
-        uint64_t instructionID = 0;  // din of the instruction
 
         // Used for stage status tracking in cycle
         StageStatus status = NORMAL;
     };
 
+   private:
+    // Direct-mapped cache of decoded instructions indexed by PC. An entry holds what
+    // simDecode produces for the word at its PC; stores over the word invalidate it.
+    struct DecodedEntry {
+        uint64_t PC = ~0ULL;
+        Instruction inst;
+    };
+    std::vector<DecodedEntry> decodedCache;
+
+    // decode a freshly fetched inst without the cache
+    void decodeInstruction(Instruction& inst);
+    // simFetch and simDecode of PC into inst, skipping both when the cache holds it
+    void fetchDecoded(uint64_t PC, Instruction& inst);
+    // drop the entries of instructions overlapping [address, address + size)
+    void invalidateDecoded(uint64_t address, uint64_t size);
+
+    // A basic block translated on its first execution: the instructions from startPC
+    // up to endPC, only the last of which may branch or jump. exits[0] chains to the
+    // block at the taken target, exits[1] to the one at endPC; each is checked
+    // against the PC it was followed for, which also covers jalr.
+    struct Block {
+        uint64_t startPC = 0;
+        uint64_t endPC = 0;
+        std::vector<MicroOp> ops;
+        bool valid = true;
+        // runs so far, towards JIT_HOT_RUNS, and the compiled code if any
+        uint32_t runs = 0;
+        Jit::BlockCode code = nullptr;
+        struct Exit {
+            uint64_t PC = ~0ULL;
+            Block* block = nullptr;
+        } exits[2];
+    };
+    // valid blocks by startPC
+    std::unordered_map<uint64_t, Block*> blocks;
+    // every block, including invalidated ones chain pointers may still reach
+    std::vector<std::unique_ptr<Block>> allBlocks;
+    // A memory page (MEM_PAGE_BITS) instructions were decoded from: the range they
+    // cover and the blocks on it
+    struct CodePage {
+        uint64_t start = ~0ULL;
+        uint64_t end = 0;
+        std::vector<Block*> blocks;
+    };
+    std::unordered_map<uint64_t, CodePage> codePages;
+    // range covering the instructions of every block, to skip most stores quickly
+    uint64_t codeStart = ~0ULL;
+    uint64_t codeEnd = 0;
+    uint64_t invalidBlocks = 0;
+    // block being translated, and whether a store overwrote its instructions
+    Block* recording = nullptr;
+    bool recordingOverwritten = false;
+
+    // simInstruction at PC, moving PC on; HALT or ERROR when it halts or is illegal
+    Status stepInstruction(uint64_t& PC);
+    // execute from PC one instruction at a time, up to remaining ones (0 for no
+    // limit), recording them as a new block that ends at the first branch or jump
+    Status recordBlock(uint64_t& PC, uint64_t remaining, uint64_t& executed);
+    // execute block, which starts at PC, and return the next block if chained or
+    // found, nullptr otherwise; compiled code may run it up to remaining instructions
+    // (0 for no limit) in a loop
+    Block* runBlock(Block* block, uint64_t& PC, uint64_t remaining, uint64_t& executed);
+    // a store to [address, address + size) invalidates the decoded instructions
+    // and blocks it overwrites
+    void invalidateCode(uint64_t address, uint64_t size);
+    // drop every decoded instruction, block and compiled block
+    void flushCode();
+
+    // compiles hot blocks when enabled, nullptr otherwise
+    std::unique_ptr<Jit> jit;
+    // block whose compiled code is running
+    Block* jitBlock = nullptr;
+    // Jit::Context callbacks for accesses compiled code doesn't make itself
+    static uint64_t jitLoad(Jit::Context* context, uint64_t address, uint64_t size,
+                            uint64_t signExtend);
+    static uint64_t jitStore(Jit::Context* context, uint64_t address, uint64_t value,
+                             uint64_t size);
+
+   public:
+
     // getters and setters
     auto getDin() { return din; }
     auto getMemory() { return memory; }
+    auto getRegisters() { return regData.registers; }
 
-    void setMemory(MemoryStore* mem) { memory = mem; }
+    void setMemory(MemoryStore* mem) {
+        memory = mem;
+        flushCode();
+    }
 
-    // Simulate by functionality (project 1)
+    // compile blocks run JIT_HOT_RUNS times to x86-64 code in simBlocks
+    void enableJit();
+
+    // Simulate by functionality (project 1), every stage but fetch updates inst in place
     Instruction simFetch(uint64_t PC, MemoryStore *myMem);
-    Instruction simDecode(Instruction inst);
-    Instruction simOperandCollection(Instruction inst, REGS regData);
-    Instruction simNextPCResolution(Instruction inst);
-    Instruction simArithLogic(Instruction inst);
-    Instruction simAddrGen(Instruction inst);
-    Instruction simMemAccess(Instruction inst, MemoryStore *myMem);
-    Instruction simCommit(Instruction inst, REGS &regData);
+    void simDecode(Instruction& inst);
+    void simOperandCollection(Instruction& inst, const REGS& regData);
+    void simNextPCResolution(Instruction& inst);
+    void simArithLogic(Instruction& inst);
+    void simAddrGen(Instruction& inst);
+    void simMemAccess(Instruction& inst, MemoryStore *myMem);
+    void simCommit(Instruction& inst, REGS &regData);
 
     // Simulate an instruction functionally in a single step
     Instruction simInstruction(uint64_t PC);
 
+    // Simulate up to instructions (0 for no limit) functionally from PC through
+    // translated basic blocks, moving PC on; same results as simInstruction. Returns
+    // HALT or ERROR like runInstructions, SUCCESS when the instructions ran.
+    Status simBlocks(uint64_t& PC, uint64_t instructions);
+
     // Simulate pipeline stages (project 2 TODO)
     Instruction simIF(uint64_t PC);
-    Instruction simID(Instruction inst);
-    Instruction simEX(Instruction inst);
-    Instruction simMEM(Instruction inst);
-    Instruction simWB(Instruction inst);
+    void simID(Instruction& inst);
+    void simEX(Instruction& inst);
+    void simMEM(Instruction& inst);
+    void simWB(Instruction& inst);
 
     // Helper function to dump registers and memory
     void dumpRegMem(const std::string& output_name);
@@ -0,0 +1,17 @@
+# A loop of loads, stores and ALU ops that runs far more often than
+# JIT_HOT_RUNS, so sim_funct --jit compiles it and runs it from compiled code.
+_start:
+	li   t1, 1000       # t1 = iterations
+	li   t0, 512        # t0 = &data
+
+loop:
+	lw   t2, 0(t0)      # t2 = data[0]
+	addi t2, t2, 3      # t2 += 3
+	xor  t3, t2, t1     # t3 = t2 ^ t1
+	sw   t3, 4(t0)      # data[1] = t3
+	slli t4, t1, 2      # t4 = t1 << 2
+	add  t5, t4, t3     # t5 = t4 + t3
+	addi t1, t1, -1     # t1--
+	bne  t1, zero, loop # if t1 != 0 goto loop
+
+.word 0xfeedfeed
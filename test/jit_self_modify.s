@@ -0,0 +1,46 @@
+# Self-modifying code in blocks hot enough to be compiled by sim_funct --jit.
+# loopA runs 40 times, then its first instruction is overwritten with patch
+# (add 100 instead of 1) and it runs 40 more: t2 = 40 + 4000.
+# loopB stores to data until s0 = 49, when the store overwrites slot, the
+# instruction after it in the running block, with patch: s0 stops counting
+# at 49 (0x31) and the last 11 iterations add 1100, t2 = 5140 (0x1414).
+_start:
+	li   t1, 40         # t1 = iterations
+	li   t2, 0          # t2 = 0
+	li   s1, 0          # s1 = loopA patched
+
+loopA:
+	addi t2, t2, 1      # overwritten with patch after the first pass
+	addi t1, t1, -1     # t1--
+	bne  t1, zero, loopA # if t1 != 0 goto loopA
+	bne  s1, zero, partB # second pass done
+	li   s1, 1
+	li   t0, 112        # t0 = &patch
+	lw   gp, 0(t0)      # gp = patch instruction
+	li   t0, 12         # t0 = &loopA
+	sw   gp, 0(t0)      # loopA = patch
+	li   t1, 40
+	j    loopA
+
+partB:
+	li   t1, 60         # t1 = iterations
+	li   s0, 0          # s0 = 0
+	li   t0, 1024       # t0 = &data
+	li   ra, -928       # ra = &slot - &data
+
+loopB:
+	xori sp, s0, 49
+	sltiu sp, sp, 1
+	sub  sp, zero, sp   # sp = (s0 == 49) ? -1 : 0
+	and  sp, sp, ra
+	add  tp, t0, sp     # tp = (s0 == 49) ? &slot : &data
+	sw   gp, 0(tp)      # store patch there
+slot:
+	addi s0, s0, 1      # s0++, until overwritten
+	addi t1, t1, -1     # t1--
+	bne  t1, zero, loopB # if t1 != 0 goto loopB
+
+.word 0xfeedfeed
+
+patch:
+	addi t2, t2, 100
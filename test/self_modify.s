@@ -0,0 +1,20 @@
+# The store in the loop overwrites the loop's own first instruction with the
+# instruction at patch, so every iteration after the first adds 100 instead
+# of 1: t3 = 1 + 100 + 100 = 201 (0xc9) at the end.
+_start:
+	li   t1, 3          # t1 = iterations
+	li   t3, 0          # t3 = 0
+	li   t0, 56         # t0 = &patch
+	lw   t2, 0(t0)      # t2 = patch instruction
+
+loop:
+	addi t3, t3, 1      # overwritten by the store below
+	sw   t2, 16(zero)   # loop = patch
+	addi t1, t1, -1     # t1--
+	bne  t1, zero, loop # if t1 != 0 goto loop
+
+.word 0xfeedfeed
+
+	.space 20
+patch:
+	addi t3, t3, 100